@@ -0,0 +1,148 @@
+#ifndef BATCH_QUERIES_HPP
+#define BATCH_QUERIES_HPP
+
+#include <cstddef>
+#include <cstdint>
+#include <functional>
+#include <vector>
+#include <dake/math/matrix.hpp>
+
+#include "knn_approximation.hpp"
+#include "parallel.hpp"
+#include "point.hpp"
+
+
+// Runs many queries of a spatial index at once on all cores. Index has to
+// provide knn(position, neighbors, indices, sq_dists, approx),
+// all_knn(points, neighbors, indices, sq_dists, progress, approx),
+// radius_search(position, radius, indices, sq_dists), radius_count(position,
+// radius) and box_count(min, max), as spatial_index<K> does.
+template<typename Index, unsigned K>
+class batch_queries {
+    public:
+        typedef dake::math::vec<K, float> vector;
+
+        // Runs a KNN query for each of count positions (position_of(i) giving
+        // the i-th) on all cores and calls
+        // result(i, indices, sq_dists, found) for each with the query's
+        // results as described for knn(). result() is called from multiple
+        // threads at once, but never twice for the same i.
+        template<typename PositionFn, typename ResultFn>
+        void knn_for_each(size_t count, PositionFn position_of, unsigned neighbors, ResultFn result,
+                          const std::function<void(size_t)> &progress = std::function<void(size_t)>(),
+                          const knn_approximation &approx = knn_approximation()) const
+        {
+            parallel_for(count, BATCH_CHUNK_SIZE, [&](size_t begin, size_t end) {
+                std::vector<uint32_t> indices(neighbors);
+                std::vector<float> sq_dists(neighbors);
+
+                for (size_t i = begin; i < end; i++) {
+                    unsigned found = index().knn(position_of(i), neighbors, indices.data(), sq_dists.data(), approx);
+                    result(i, static_cast<const uint32_t *>(indices.data()), static_cast<const float *>(sq_dists.data()), found);
+                }
+            }, progress);
+        }
+
+        // Same as above, but writes the results of query i to
+        // indices[i * neighbors] and sq_dists[i * neighbors] (following
+        // entries)
+        template<typename PositionFn>
+        void knn_batch(size_t count, PositionFn position_of, unsigned neighbors, uint32_t *indices, float *sq_dists,
+                       const std::function<void(size_t)> &progress = std::function<void(size_t)>(),
+                       const knn_approximation &approx = knn_approximation()) const
+        {
+            parallel_for(count, BATCH_CHUNK_SIZE, [&](size_t begin, size_t end) {
+                for (size_t i = begin; i < end; i++) {
+                    index().knn(position_of(i), neighbors, indices + i * neighbors, sq_dists + i * neighbors, approx);
+                }
+            }, progress);
+        }
+
+        // Runs a KNN query for every point in points (the point array the
+        // index has been built over) through all_knn() and then calls
+        // result(i, indices, sq_dists, found) for each, with the same
+        // threading rules as knn_for_each()
+        template<typename ResultFn>
+        void all_knn_for_each(const std::vector<point> &points, unsigned neighbors, ResultFn result,
+                              const std::function<void(size_t)> &progress = std::function<void(size_t)>(),
+                              const knn_approximation &approx = knn_approximation()) const
+        {
+            std::vector<uint32_t> indices(points.size() * neighbors);
+            std::vector<float> sq_dists(points.size() * neighbors);
+
+            index().all_knn(points, neighbors, indices.data(), sq_dists.data(), progress, approx);
+
+            parallel_for(points.size(), BATCH_CHUNK_SIZE, [&](size_t begin, size_t end) {
+                for (size_t i = begin; i < end; i++) {
+                    const uint32_t *knn = indices.data() + i * neighbors;
+
+                    // Only clouds with fewer points than neighbors leave gaps
+                    unsigned found = neighbors;
+                    while (found && (knn[found - 1] == Index::NO_NEIGHBOR)) {
+                        found--;
+                    }
+
+                    result(i, knn, static_cast<const float *>(sq_dists.data() + i * neighbors), found);
+                }
+            });
+        }
+
+        // Runs radius_search() for count positions (position_of(i) giving the
+        // i-th) on all cores and calls result(i, indices, sq_dists, found) for
+        // each, with the same threading rules as knn_for_each()
+        template<typename PositionFn, typename ResultFn>
+        void radius_for_each(size_t count, PositionFn position_of, float radius, ResultFn result,
+                             const std::function<void(size_t)> &progress = std::function<void(size_t)>()) const
+        {
+            parallel_for(count, BATCH_CHUNK_SIZE, [&](size_t begin, size_t end) {
+                std::vector<uint32_t> indices;
+                std::vector<float> sq_dists;
+
+                for (size_t i = begin; i < end; i++) {
+                    indices.clear();
+                    sq_dists.clear();
+
+                    size_t found = index().radius_search(position_of(i), radius, indices, &sq_dists);
+                    result(i, static_cast<const uint32_t *>(indices.data()), static_cast<const float *>(sq_dists.data()), found);
+                }
+            }, progress);
+        }
+
+        // Writes radius_count() for each of count positions to counts[i]
+        template<typename PositionFn>
+        void radius_count_batch(size_t count, PositionFn position_of, float radius, uint32_t *counts,
+                                const std::function<void(size_t)> &progress = std::function<void(size_t)>()) const
+        {
+            parallel_for(count, BATCH_CHUNK_SIZE, [&](size_t begin, size_t end) {
+                for (size_t i = begin; i < end; i++) {
+                    counts[i] = index().radius_count(position_of(i), radius);
+                }
+            }, progress);
+        }
+
+        // Writes box_count() for each of count boxes (box_of(i, min, max)
+        // storing the i-th to min and max) to counts[i]
+        template<typename BoxFn>
+        void box_count_batch(size_t count, BoxFn box_of, uint32_t *counts,
+                             const std::function<void(size_t)> &progress = std::function<void(size_t)>()) const
+        {
+            parallel_for(count, BATCH_CHUNK_SIZE, [&](size_t begin, size_t end) {
+                for (size_t i = begin; i < end; i++) {
+                    vector min, max;
+                    box_of(i, min, max);
+                    counts[i] = index().box_count(min, max);
+                }
+            }, progress);
+        }
+
+
+    private:
+        enum {
+            BATCH_CHUNK_SIZE = 1024
+        };
+
+        const Index &index(void) const
+        { return *static_cast<const Index *>(this); }
+};
+
+#endif
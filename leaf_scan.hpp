@@ -0,0 +1,91 @@
+#ifndef LEAF_SCAN_HPP
+#define LEAF_SCAN_HPP
+
+#include <cmath>
+#include <cstddef>
+#include <cstdint>
+#include <dake/math/matrix.hpp>
+
+#if defined(__AVX__) || defined(__SSE2__)
+#include <immintrin.h>
+#endif
+
+
+// Offers the entries [begin, end) of a structure-of-arrays position table to
+// a KNN candidate queue (see spatial_index<K>::neighbor_heap): coordinate d of
+// entry i is coords[d * stride + i], its index in the cloud ids[i]. Squared
+// distances are computed eight (AVX) or four (SSE) entries at a time and
+// compared against the queue's bound in one go, so the queue is only touched
+// for entries which actually make it in, which is rare once it is full.
+template<unsigned K, typename Queue>
+void scan_leaf(const float *coords, size_t stride, uint32_t begin, uint32_t end,
+               const dake::math::vec<K, float> &position, Queue &queue, const uint32_t *ids)
+{
+    uint32_t i = begin;
+
+    // Not full yet means everything is good enough (except for holes, which
+    // are infinitely far away and thus never below this)
+    auto bound = [&](void) { return queue.full() ? queue.bound() : HUGE_VALF; };
+
+#ifdef __AVX__
+    for (; i + 8 <= end; i += 8) {
+        __m256 sq_dist = _mm256_setzero_ps();
+        for (unsigned d = 0; d < K; d++) {
+            __m256 diff = _mm256_sub_ps(_mm256_loadu_ps(coords + d * stride + i), _mm256_set1_ps(position[d]));
+#ifdef __FMA__
+            sq_dist = _mm256_fmadd_ps(diff, diff, sq_dist);
+#else
+            sq_dist = _mm256_add_ps(sq_dist, _mm256_mul_ps(diff, diff));
+#endif
+        }
+
+        int mask = _mm256_movemask_ps(_mm256_cmp_ps(sq_dist, _mm256_set1_ps(bound()), _CMP_LT_OQ));
+        if (!mask) {
+            continue;
+        }
+
+        alignas(32) float sq_dists[8];
+        _mm256_store_ps(sq_dists, sq_dist);
+        for (; mask; mask &= mask - 1) {
+            int j = __builtin_ctz(mask);
+            queue.offer(ids[i + j], sq_dists[j]);
+        }
+    }
+#endif
+
+#ifdef __SSE2__
+    for (; i + 4 <= end; i += 4) {
+        __m128 sq_dist = _mm_setzero_ps();
+        for (unsigned d = 0; d < K; d++) {
+            __m128 diff = _mm_sub_ps(_mm_loadu_ps(coords + d * stride + i), _mm_set1_ps(position[d]));
+            sq_dist = _mm_add_ps(sq_dist, _mm_mul_ps(diff, diff));
+        }
+
+        int mask = _mm_movemask_ps(_mm_cmplt_ps(sq_dist, _mm_set1_ps(bound())));
+        if (!mask) {
+            continue;
+        }
+
+        alignas(16) float sq_dists[4];
+        _mm_store_ps(sq_dists, sq_dist);
+        for (; mask; mask &= mask - 1) {
+            int j = __builtin_ctz(mask);
+            queue.offer(ids[i + j], sq_dists[j]);
+        }
+    }
+#endif
+
+    for (; i < end; i++) {
+        float sq_dist = 0.f;
+        for (unsigned d = 0; d < K; d++) {
+            float diff = coords[d * stride + i] - position[d];
+            sq_dist += diff * diff;
+        }
+
+        if (sq_dist < bound()) {
+            queue.offer(ids[i], sq_dist);
+        }
+    }
+}
+
+#endif
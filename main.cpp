@@ -1,7 +1,6 @@
-#include <cerrno>
 #include <cstdio>
 #include <cstring>
-#include <fstream>
+#include <exception>
 #include <iostream>
 #include <libgen.h>
 #include <QApplication>
@@ -18,19 +17,14 @@ int main(int argc, char *argv[])
     QApplication app(argc, argv);
 
     for (int i = 1; i < argc; i++) {
-        std::ifstream inp(argv[i]);
-        if (!inp.is_open()) {
-            fprintf(stderr, "%s: Could not open %s: %s\n", argv[0], argv[i], strerror(errno));
-            // If you suddenly feel the urge for refreshment after actually
-            // reading "strerror(errno)" in a C++ program using STL I/O streams,
-            // you may find my comments in window.cpp amusing
-            // (maybe I should've just sticked to C and Gtk2)
-            return 1;
-        }
-
         char name_copy[strlen(argv[i]) + 1];
         strcpy(name_copy, argv[i]);
-        cm.load_new(inp, basename(name_copy));
+        try {
+            cm.load_new(argv[i], basename(name_copy));
+        } catch (const std::exception &e) {
+            fprintf(stderr, "%s: Could not load from %s: %s\n", argv[0], argv[i], e.what());
+            return 1;
+        }
     }
 
     // Putting this in something fancy like an std::shared_ptr doesn't suit Qt,
@@ -0,0 +1,98 @@
+#ifndef MAPPED_FILE_HPP
+#define MAPPED_FILE_HPP
+
+#include <cerrno>
+#include <cstddef>
+#include <cstring>
+#include <stdexcept>
+#include <string>
+
+#ifdef _WIN32
+#include <fstream>
+#include <iterator>
+#include <vector>
+#else
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+
+// Read-only view of a whole file. It is memory-mapped, so nothing is read
+// before it is actually accessed (and pages are shared with the page cache);
+// Windows just gets the file read into memory.
+class mapped_file {
+    public:
+        mapped_file(const std::string &path)
+        {
+#ifdef _WIN32
+            std::ifstream s(path, std::ios_base::in | std::ios_base::binary);
+            if (!s.is_open()) {
+                throw std::runtime_error("Could not open " + path + ": " + strerror(errno));
+            }
+
+            buffer.assign(std::istreambuf_iterator<char>(s), std::istreambuf_iterator<char>());
+            ptr = buffer.data();
+            length = buffer.size();
+#else
+            int fd = open(path.c_str(), O_RDONLY);
+            if (fd < 0) {
+                throw std::runtime_error("Could not open " + path + ": " + strerror(errno));
+            }
+
+            struct stat st;
+            if (fstat(fd, &st) < 0) {
+                int err = errno;
+                close(fd);
+                throw std::runtime_error("Could not stat " + path + ": " + strerror(err));
+            }
+            length = st.st_size;
+
+            // mmap() does not like empty mappings
+            if (length) {
+                void *map = mmap(nullptr, length, PROT_READ, MAP_PRIVATE, fd, 0);
+                if (map == MAP_FAILED) {
+                    int err = errno;
+                    close(fd);
+                    throw std::runtime_error("Could not map " + path + ": " + strerror(err));
+                }
+
+                madvise(map, length, MADV_SEQUENTIAL);
+                ptr = static_cast<const char *>(map);
+            }
+
+            // The mapping stays valid without the descriptor
+            close(fd);
+#endif
+        }
+
+        ~mapped_file(void)
+        {
+#ifndef _WIN32
+            if (ptr) {
+                munmap(const_cast<char *>(ptr), length);
+            }
+#endif
+        }
+
+        mapped_file(const mapped_file &) = delete;
+        mapped_file &operator=(const mapped_file &) = delete;
+
+        const char *data(void) const
+        { return ptr; }
+
+        size_t size(void) const
+        { return length; }
+
+
+    private:
+        const char *ptr = nullptr;
+        size_t length = 0;
+
+#ifdef _WIN32
+        std::vector<char> buffer;
+#endif
+};
+
+#endif
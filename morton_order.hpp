@@ -0,0 +1,185 @@
+#ifndef MORTON_ORDER_HPP
+#define MORTON_ORDER_HPP
+
+#include <algorithm>
+#include <cassert>
+#include <cmath>
+#include <cstdint>
+#include <utility>
+#include <vector>
+#include <dake/math/matrix.hpp>
+
+#include "parallel.hpp"
+#include "point.hpp"
+#include "spatial_index.hpp"
+
+
+// The points of a cloud sorted along a Z-order curve over a regular grid
+// spanning their bounding box. As the code of a cell at some level is just the
+// code of a finer cell shifted right by K bits per level, the points of every
+// cell on every level form a contiguous range in this order, which is what the
+// uniform grid and the octree are built from.
+template<unsigned K>
+struct morton_order {
+    typedef dake::math::vec<K, float> vector;
+
+    enum {
+        // Bits per dimension (21 for three dimensions)
+        BITS = 63 / K,
+        CHUNK_SIZE = 65536
+    };
+
+    vector bounds_min, bounds_max;
+    // Edge length of the cells on the finest level (level 0); those on level
+    // l are 2^l times as big
+    float cell_size;
+
+    // All of these in Z-order
+    std::vector<uint64_t> codes;
+    std::vector<uint32_t> indices;
+    std::vector<vector> positions;
+
+
+    morton_order(const std::vector<point> &points)
+    {
+        assert(points.size() <= UINT32_MAX);
+
+        point_bounds<K>(points, bounds_min, bounds_max);
+
+        float max_extent = 0.f;
+        for (unsigned d = 0; d < K; d++) {
+            max_extent = std::max(max_extent, bounds_max[d] - bounds_min[d]);
+        }
+        // Slightly bigger, so the maximum does not end up in a cell of its own
+        // beyond the grid
+        cell_size = max_extent > 0.f ? max_extent * (1.f + 1e-6f) / (UINT64_C(1) << BITS) : 1.f;
+
+        std::vector<std::pair<uint64_t, uint32_t>> order(points.size());
+        parallel_for(points.size(), CHUNK_SIZE, [&](size_t begin, size_t end) {
+            for (size_t i = begin; i < end; i++) {
+                uint32_t coords[K];
+                cell_coords(points[i].position, 0, coords);
+                order[i] = std::make_pair(code(coords), static_cast<uint32_t>(i));
+            }
+        });
+
+        parallel_sort(order, [](const std::pair<uint64_t, uint32_t> &o1, const std::pair<uint64_t, uint32_t> &o2) {
+            return o1.first < o2.first;
+        });
+
+        codes.resize(points.size());
+        indices.resize(points.size());
+        positions.resize(points.size());
+        parallel_for(points.size(), CHUNK_SIZE, [&](size_t begin, size_t end) {
+            for (size_t i = begin; i < end; i++) {
+                codes[i]   = order[i].first;
+                indices[i] = order[i].second;
+                for (unsigned d = 0; d < K; d++) {
+                    positions[i][d] = points[indices[i]].position[d];
+                }
+            }
+        });
+    }
+
+
+    // Edge length of the cells on the given level
+    float level_cell_size(unsigned level) const
+    { return ldexpf(cell_size, level); }
+
+    // Number of cells per dimension on the given level
+    static int64_t level_cells(unsigned level)
+    { return INT64_C(1) << (BITS - level); }
+
+    // Coordinates of the cell containing position on the given level, clamped
+    // to the grid
+    void cell_coords(const vector &position, unsigned level, uint32_t *coords) const
+    {
+        int64_t signed_coords[K];
+        unclamped_cell_coords(position, level, signed_coords);
+
+        for (unsigned d = 0; d < K; d++) {
+            coords[d] = std::min(std::max(signed_coords[d], INT64_C(0)), level_cells(level) - 1);
+        }
+    }
+
+    // Same, but not clamped (so they may be outside of the grid for positions
+    // outside of the bounding box)
+    void unclamped_cell_coords(const vector &position, unsigned level, int64_t *coords) const
+    {
+        float size = level_cell_size(level);
+
+        for (unsigned d = 0; d < K; d++) {
+            float c = floorf((position[d] - bounds_min[d]) / size);
+            // Keep far away positions from overflowing
+            c = std::min(std::max(c, -static_cast<float>(INT32_MAX)), static_cast<float>(INT32_MAX));
+            coords[d] = static_cast<int64_t>(c);
+        }
+    }
+
+    // Code of the cell with the given coordinates (on any level; the code
+    // belongs to the same level the coordinates do)
+    static uint64_t code(const uint32_t *coords)
+    {
+        uint64_t c = 0;
+        for (unsigned d = 0; d < K; d++) {
+            c |= spread(coords[d]) << d;
+        }
+        return c;
+    }
+
+    // Inverse of code()
+    static void decode(uint64_t c, uint32_t *coords)
+    {
+        for (unsigned d = 0; d < K; d++) {
+            coords[d] = compact(c >> d);
+        }
+    }
+
+
+    private:
+        // Moves bit i of v to bit K * i
+        static uint64_t spread(uint32_t v)
+        {
+            uint64_t s = 0;
+            for (unsigned i = 0; i < BITS; i++) {
+                s |= static_cast<uint64_t>((v >> i) & 1) << (K * i);
+            }
+            return s;
+        }
+
+        static uint32_t compact(uint64_t s)
+        {
+            uint32_t v = 0;
+            for (unsigned i = 0; i < BITS; i++) {
+                v |= static_cast<uint32_t>((s >> (K * i)) & 1) << i;
+            }
+            return v;
+        }
+};
+
+
+// The usual magic numbers for three dimensions, which is all this program ever
+// uses
+template<> inline uint64_t morton_order<3>::spread(uint32_t v)
+{
+    uint64_t s = v & 0x1fffff;
+    s = (s | (s << 32)) & UINT64_C(0x1f00000000ffff);
+    s = (s | (s << 16)) & UINT64_C(0x1f0000ff0000ff);
+    s = (s | (s <<  8)) & UINT64_C(0x100f00f00f00f00f);
+    s = (s | (s <<  4)) & UINT64_C(0x10c30c30c30c30c3);
+    s = (s | (s <<  2)) & UINT64_C(0x1249249249249249);
+    return s;
+}
+
+template<> inline uint32_t morton_order<3>::compact(uint64_t s)
+{
+    s &= UINT64_C(0x1249249249249249);
+    s = (s | (s >>  2)) & UINT64_C(0x10c30c30c30c30c3);
+    s = (s | (s >>  4)) & UINT64_C(0x100f00f00f00f00f);
+    s = (s | (s >>  8)) & UINT64_C(0x1f0000ff0000ff);
+    s = (s | (s >> 16)) & UINT64_C(0x1f00000000ffff);
+    s = (s | (s >> 32)) & UINT64_C(0x1fffff);
+    return static_cast<uint32_t>(s);
+}
+
+#endif
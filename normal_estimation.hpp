@@ -0,0 +1,193 @@
+#ifndef NORMAL_ESTIMATION_HPP
+#define NORMAL_ESTIMATION_HPP
+
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+#include <dake/math/matrix.hpp>
+
+#include "point.hpp"
+
+
+#ifndef M_PI
+#define M_PI 3.14159265358979323846
+#endif
+
+
+// Estimates the normals of W neighborhoods at once: neighborhood l consists of
+// the counts[l] points points[neighbors[l][0..counts[l] - 1]]. The normal is
+// the eigenvector of the neighborhood's covariance matrix to its smallest
+// eigenvalue, the curvature (or rather surface variation) that eigenvalue
+// divided by the sum of all three, i.e. 0 for a plane and 1/3 for an isotropic
+// blob. The covariances are accumulated lane by lane on W-wide arrays, so the
+// compiler can vectorize that part; the eigenproblems are then solved one by
+// one. Neighborhoods with no points at all get a zero normal.
+template<unsigned W>
+void estimate_normals(const point *points, const uint32_t *const *neighbors, const unsigned *counts,
+                      dake::math::vec3 *normals, float *curvatures)
+{
+    using namespace dake::math;
+
+    // Covariances are accumulated in a single pass relative to the first
+    // point of every neighborhood, which keeps the sums small (and the
+    // cancellation in E[xy] - E[x]E[y] harmless) even far from the origin
+    float ox[W], oy[W], oz[W];
+    float sx[W], sy[W], sz[W], sxx[W], sxy[W], sxz[W], syy[W], syz[W], szz[W];
+
+    unsigned max_count = 0;
+    for (unsigned l = 0; l < W; l++) {
+        if (counts[l]) {
+            const vec3 &origin = points[neighbors[l][0]].position;
+            ox[l] = origin.x();
+            oy[l] = origin.y();
+            oz[l] = origin.z();
+        } else {
+            ox[l] = oy[l] = oz[l] = 0.f;
+        }
+
+        sx[l] = sy[l] = sz[l] = sxx[l] = sxy[l] = sxz[l] = syy[l] = syz[l] = szz[l] = 0.f;
+        max_count = std::max(max_count, counts[l]);
+    }
+
+    for (unsigned j = 0; j < max_count; j++) {
+        float x[W], y[W], z[W];
+
+        for (unsigned l = 0; l < W; l++) {
+            if (j < counts[l]) {
+                const vec3 &pos = points[neighbors[l][j]].position;
+                x[l] = pos.x() - ox[l];
+                y[l] = pos.y() - oy[l];
+                z[l] = pos.z() - oz[l];
+            } else {
+                x[l] = y[l] = z[l] = 0.f;
+            }
+        }
+
+        for (unsigned l = 0; l < W; l++) {
+            sx[l]  += x[l];
+            sy[l]  += y[l];
+            sz[l]  += z[l];
+            sxx[l] += x[l] * x[l];
+            sxy[l] += x[l] * y[l];
+            sxz[l] += x[l] * z[l];
+            syy[l] += y[l] * y[l];
+            syz[l] += y[l] * z[l];
+            szz[l] += z[l] * z[l];
+        }
+    }
+
+    for (unsigned l = 0; l < W; l++) {
+        if (!counts[l]) {
+            normals[l] = vec3::zero();
+            curvatures[l] = 0.f;
+            continue;
+        }
+
+        // The sums are fine in float, but solving in float is not: for
+        // elongated neighborhoods, acos() near 1 loses so much that the error
+        // in the smallest eigenvalue exceeds the middle one
+        double inv_n = 1. / counts[l];
+        double mx = sx[l] * inv_n, my = sy[l] * inv_n, mz = sz[l] * inv_n;
+
+        double a[3][3];
+        a[0][0] = sxx[l] * inv_n - mx * mx;
+        a[0][1] = a[1][0] = sxy[l] * inv_n - mx * my;
+        a[0][2] = a[2][0] = sxz[l] * inv_n - mx * mz;
+        a[1][1] = syy[l] * inv_n - my * my;
+        a[1][2] = a[2][1] = syz[l] * inv_n - my * mz;
+        a[2][2] = szz[l] * inv_n - mz * mz;
+
+        // Eigenvalues in closed form (the trigonometric solution of the
+        // characteristic polynomial, which only has real roots for symmetric
+        // matrices)
+        double q = (a[0][0] + a[1][1] + a[2][2]) / 3.;
+        double p1 = a[0][1] * a[0][1] + a[0][2] * a[0][2] + a[1][2] * a[1][2];
+        double p2 = (a[0][0] - q) * (a[0][0] - q) + (a[1][1] - q) * (a[1][1] - q) + (a[2][2] - q) * (a[2][2] - q) + 2. * p1;
+
+        if (!std::isfinite(q) || !std::isfinite(p2)) {
+            // NaN or infinite coordinates in the neighborhood; there is no
+            // sensible normal then
+            normals[l] = vec3::zero();
+            curvatures[l] = 0.f;
+            continue;
+        }
+
+        if (!(p2 > 0.)) {
+            // All eigenvalues are the same (a single point, or a perfectly
+            // isotropic neighborhood), so any direction is as good as another
+            normals[l] = vec3(0.f, 0.f, 1.f);
+            curvatures[l] = q > 0. ? 1.f / 3.f : 0.f;
+            continue;
+        }
+
+        double p = sqrt(p2 / 6.);
+        double b[3][3];
+        for (int r = 0; r < 3; r++) {
+            for (int c = 0; c < 3; c++) {
+                b[r][c] = (a[r][c] - (r == c ? q : 0.)) / p;
+            }
+        }
+
+        double half_det = (b[0][0] * (b[1][1] * b[2][2] - b[1][2] * b[2][1])
+                         - b[0][1] * (b[1][0] * b[2][2] - b[1][2] * b[2][0])
+                         + b[0][2] * (b[1][0] * b[2][1] - b[1][1] * b[2][0])) / 2.;
+        double phi = acos(std::min(std::max(half_det, -1.), 1.)) / 3.;
+
+        double ev_max = q + 2. * p * cos(phi);
+        double ev_min = q + 2. * p * cos(phi + 2. * M_PI / 3.);
+
+        auto cross = [](const double *u, const double *v, double *w) {
+            w[0] = u[1] * v[2] - u[2] * v[1];
+            w[1] = u[2] * v[0] - u[0] * v[2];
+            w[2] = u[0] * v[1] - u[1] * v[0];
+        };
+
+        // The eigenvector is orthogonal to all rows of A - ev * I; take the
+        // cross product of the two rows which give the longest one
+        auto null_vector = [&](double ev, double *v) {
+            double rows[3][3];
+            for (int r = 0; r < 3; r++) {
+                for (int c = 0; c < 3; c++) {
+                    rows[r][c] = a[r][c] - (r == c ? ev : 0.);
+                }
+            }
+
+            static const int pairs[3][2] = {{0, 1}, {0, 2}, {1, 2}};
+            double best = 0.;
+            for (const int *pair: pairs) {
+                double cand[3];
+                cross(rows[pair[0]], rows[pair[1]], cand);
+
+                double sq_len = cand[0] * cand[0] + cand[1] * cand[1] + cand[2] * cand[2];
+                if (sq_len > best) {
+                    best = sq_len;
+                    std::copy(cand, cand + 3, v);
+                }
+            }
+            return best;
+        };
+
+        double n[3] = {0., 0., 1.};
+        double scale = ev_max * ev_max;
+        if (null_vector(ev_min, n) <= 1e-20 * scale * scale) {
+            // The smallest eigenvalue is a double one (the neighborhood is a
+            // line), so every direction orthogonal to the line will do
+            double line[3] = {1., 0., 0.};
+            double line_len = sqrt(null_vector(ev_max, line));
+            if (line_len > 0.) {
+                for (double &c: line) {
+                    c /= line_len;
+                }
+            }
+
+            double axis[3] = {0., 0., 0.};
+            axis[fabs(line[0]) < .9 ? 0 : 1] = 1.;
+            cross(line, axis, n);
+        }
+
+        normals[l] = vec3(n[0], n[1], n[2]).normalized();
+        curvatures[l] = std::max(ev_min, 0.) / (3. * q);
+    }
+}
+
+#endif
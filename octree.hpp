@@ -0,0 +1,434 @@
+#ifndef OCTREE_HPP
+#define OCTREE_HPP
+
+#include <algorithm>
+#include <cassert>
+#include <cmath>
+#include <cstdint>
+#include <vector>
+#include <dake/math/matrix.hpp>
+
+#include "knn_approximation.hpp"
+#include "morton_order.hpp"
+#include "point.hpp"
+#include "spatial_index.hpp"
+
+
+// Octree (well, a 2^K-tree) built from the points' Z-order: Every node covers
+// a contiguous range of it, its children split that range along the next K
+// bits of the codes. Chains of nodes with a single child are collapsed and
+// every node stores the tight bounding box of its points, so empty space is
+// pruned right away. Unlike the kd tree, every level of this tree is a
+// uniform subdivision of space, which makes it suitable for levels of detail
+// (see representatives()).
+template<unsigned K>
+class octree final: public spatial_index<K> {
+    public:
+        typedef typename spatial_index<K>::vector vector;
+
+        enum : uint32_t {
+            NO_NEIGHBOR = spatial_index<K>::NO_NEIGHBOR
+        };
+
+
+        octree(const std::vector<point> &points, unsigned leaf_points = 16):
+            order(points),
+            max_leaf_points(leaf_points ? leaf_points : 1)
+        {
+            if (!order.codes.empty()) {
+                nodes.emplace_back();
+                build(0, 0, order.codes.size(), morton_order<K>::BITS);
+            }
+        }
+
+        octree(const octree &) = delete;
+        octree &operator=(const octree &) = delete;
+
+
+        size_t size(void) const override
+        { return order.indices.size(); }
+
+        // Appends one point per occupied cell of the subdivision at the given
+        // depth (i.e., of cells 2^depth times smaller than the bounding box's
+        // longest edge) to indices, namely the one nearest to the center of
+        // the points in that cell; so the result is a uniformly thinned out
+        // version of the cloud which gets finer with increasing depth.
+        void representatives(unsigned depth, std::vector<uint32_t> &indices) const
+        {
+            if (!nodes.empty()) {
+                unsigned level = depth < morton_order<K>::BITS ? morton_order<K>::BITS - depth : 0;
+                representatives_step(0, level, indices);
+            }
+        }
+
+        unsigned knn(const vector &position, unsigned neighbors, uint32_t *indices, float *sq_dists,
+                     const knn_approximation &approx = knn_approximation()) const override
+        {
+            assert(neighbors > 0);
+
+            if (neighbors == 1) {
+                return knn_collect<typename spatial_index<K>::single_neighbor>(position, neighbors, indices, sq_dists, approx);
+            } else {
+                return knn_collect<typename spatial_index<K>::neighbor_heap>(position, neighbors, indices, sq_dists, approx);
+            }
+        }
+
+        size_t radius_search(const vector &position, float radius, std::vector<uint32_t> &indices,
+                             std::vector<float> *sq_dists = nullptr) const override
+        {
+            size_t found = 0;
+            float sq_radius = radius * radius;
+
+            radius_nodes(0, position, sq_radius, [&](const node &n, bool) {
+                for (uint32_t i = n.begin; i < n.end; i++) {
+                    vector diff = position - order.positions[i];
+                    float sq_dist = diff.dot(diff);
+                    if (sq_dist <= sq_radius) {
+                        indices.push_back(order.indices[i]);
+                        if (sq_dists) {
+                            sq_dists->push_back(sq_dist);
+                        }
+                        found++;
+                    }
+                }
+            });
+
+            return found;
+        }
+
+        // Nodes completely inside of the sphere are counted without being
+        // visited
+        size_t radius_count(const vector &position, float radius) const override
+        {
+            size_t found = 0;
+            float sq_radius = radius * radius;
+
+            radius_nodes(0, position, sq_radius, [&](const node &n, bool contained) {
+                if (contained) {
+                    found += n.end - n.begin;
+                    return;
+                }
+
+                for (uint32_t i = n.begin; i < n.end; i++) {
+                    vector diff = position - order.positions[i];
+                    if (diff.dot(diff) <= sq_radius) {
+                        found++;
+                    }
+                }
+            });
+
+            return found;
+        }
+
+        size_t box_search(const vector &min, const vector &max, std::vector<uint32_t> &indices) const override
+        {
+            size_t found = 0;
+
+            box_nodes(0, min, max, [&](const node &n, bool) {
+                for (uint32_t i = n.begin; i < n.end; i++) {
+                    if (in_box(order.positions[i], min, max)) {
+                        indices.push_back(order.indices[i]);
+                        found++;
+                    }
+                }
+            });
+
+            return found;
+        }
+
+        size_t box_count(const vector &min, const vector &max) const override
+        {
+            size_t found = 0;
+
+            box_nodes(0, min, max, [&](const node &n, bool contained) {
+                if (contained) {
+                    found += n.end - n.begin;
+                    return;
+                }
+
+                for (uint32_t i = n.begin; i < n.end; i++) {
+                    if (in_box(order.positions[i], min, max)) {
+                        found++;
+                    }
+                }
+            });
+
+            return found;
+        }
+
+
+    private:
+        enum {
+            CHILDREN = 1 << K
+        };
+
+        struct node {
+            // Tight bounds of the node's points
+            vector min, max;
+            // Range in the Z-order
+            uint32_t begin, end;
+            // Children are stored consecutively; leaves have none
+            uint32_t first_child, child_count;
+            // All codes in the node agree above this level
+            uint32_t level;
+        };
+
+        template<typename Queue>
+        using knn_search = typename spatial_index<K>::template knn_search<Queue>;
+
+        morton_order<K> order;
+        unsigned max_leaf_points;
+        std::vector<node> nodes;
+
+
+        // Builds the node at index from the range [begin, end), whose codes
+        // all agree above the given level
+        void build(uint32_t index, uint32_t begin, uint32_t end, unsigned level)
+        {
+            // Skip levels which do not split the range
+            while (level > 0) {
+                unsigned shift = K * (level - 1);
+                if ((order.codes[begin] >> shift) != (order.codes[end - 1] >> shift)) {
+                    break;
+                }
+                level--;
+            }
+
+            nodes[index].begin = begin;
+            nodes[index].end   = end;
+            nodes[index].child_count = 0;
+            nodes[index].level = level;
+
+            if ((end - begin <= max_leaf_points) || !level) {
+                for (unsigned d = 0; d < K; d++) {
+                    nodes[index].min[d] =  HUGE_VALF;
+                    nodes[index].max[d] = -HUGE_VALF;
+                }
+                for (uint32_t i = begin; i < end; i++) {
+                    for (unsigned d = 0; d < K; d++) {
+                        nodes[index].min[d] = std::min(nodes[index].min[d], order.positions[i][d]);
+                        nodes[index].max[d] = std::max(nodes[index].max[d], order.positions[i][d]);
+                    }
+                }
+                return;
+            }
+
+            // Split by the K bits for the next level
+            unsigned shift = K * (level - 1);
+            uint32_t child_begin[CHILDREN + 1];
+            unsigned child_count = 0;
+
+            for (uint32_t i = begin; i < end;) {
+                uint64_t prefix = order.codes[i] >> shift;
+                child_begin[child_count++] = i;
+                i = std::upper_bound(order.codes.begin() + i, order.codes.begin() + end, (prefix << shift) | ((UINT64_C(1) << shift) - 1)) - order.codes.begin();
+            }
+            child_begin[child_count] = end;
+
+            uint32_t first_child = nodes.size();
+            nodes[index].first_child = first_child;
+            nodes[index].child_count = child_count;
+            nodes.resize(nodes.size() + child_count);
+
+            for (unsigned c = 0; c < child_count; c++) {
+                build(first_child + c, child_begin[c], child_begin[c + 1], level - 1);
+            }
+
+            // nodes may have been reallocated meanwhile
+            node &n = nodes[index];
+            for (unsigned d = 0; d < K; d++) {
+                n.min[d] =  HUGE_VALF;
+                n.max[d] = -HUGE_VALF;
+                for (unsigned c = 0; c < child_count; c++) {
+                    n.min[d] = std::min(n.min[d], nodes[first_child + c].min[d]);
+                    n.max[d] = std::max(n.max[d], nodes[first_child + c].max[d]);
+                }
+            }
+        }
+
+        static bool in_box(const vector &p, const vector &min, const vector &max)
+        {
+            for (unsigned d = 0; d < K; d++) {
+                if ((p[d] < min[d]) || (p[d] > max[d])) {
+                    return false;
+                }
+            }
+            return true;
+        }
+
+        static float sq_dist_to_node(const vector &position, const node &n)
+        {
+            float sq_dist = 0.f;
+            for (unsigned d = 0; d < K; d++) {
+                float out = std::max(std::max(n.min[d] - position[d], position[d] - n.max[d]), 0.f);
+                sq_dist += out * out;
+            }
+            return sq_dist;
+        }
+
+        void representatives_step(uint32_t index, unsigned level, std::vector<uint32_t> &indices) const
+        {
+            const node &n = nodes[index];
+
+            if ((n.level > level) && n.child_count) {
+                for (uint32_t c = 0; c < n.child_count; c++) {
+                    representatives_step(n.first_child + c, level, indices);
+                }
+                return;
+            }
+
+            // A node above the level (which then is a leaf) may still span
+            // multiple cells; they are consecutive runs in its range
+            unsigned shift = K * level;
+            for (uint32_t begin = n.begin, end; begin < n.end; begin = end) {
+                vector center = vector::zero();
+                for (end = begin; (end < n.end) && ((order.codes[end] >> shift) == (order.codes[begin] >> shift)); end++) {
+                    center += order.positions[end];
+                }
+                center /= static_cast<float>(end - begin);
+
+                uint32_t best = begin;
+                float best_sq_dist = HUGE_VALF;
+
+                for (uint32_t i = begin; i < end; i++) {
+                    vector diff = center - order.positions[i];
+                    float sq_dist = diff.dot(diff);
+                    if (sq_dist < best_sq_dist) {
+                        best = i;
+                        best_sq_dist = sq_dist;
+                    }
+                }
+
+                indices.push_back(order.indices[best]);
+            }
+        }
+
+        // Calls fn(node, contained) for all nodes which must be looked at for
+        // the sphere: those which are contained completely and leaves which
+        // intersect it
+        template<typename Fn>
+        void radius_nodes(uint32_t index, const vector &position, float sq_radius, Fn &&fn) const
+        {
+            if (nodes.empty()) {
+                return;
+            }
+
+            const node &n = nodes[index];
+
+            float sq_near = 0.f, sq_far = 0.f;
+            for (unsigned d = 0; d < K; d++) {
+                float to_min = position[d] - n.min[d];
+                float to_max = n.max[d] - position[d];
+
+                float near = std::max(std::max(-to_min, -to_max), 0.f);
+                float far  = std::max(fabsf(to_min), fabsf(to_max));
+                sq_near += near * near;
+                sq_far  += far * far;
+            }
+
+            if (sq_near > sq_radius) {
+                return;
+            }
+
+            if (sq_far <= sq_radius) {
+                fn(n, true);
+            } else if (!n.child_count) {
+                fn(n, false);
+            } else {
+                for (uint32_t c = 0; c < n.child_count; c++) {
+                    radius_nodes(n.first_child + c, position, sq_radius, fn);
+                }
+            }
+        }
+
+        template<typename Fn>
+        void box_nodes(uint32_t index, const vector &min, const vector &max, Fn &&fn) const
+        {
+            if (nodes.empty()) {
+                return;
+            }
+
+            const node &n = nodes[index];
+
+            bool contained = true;
+            for (unsigned d = 0; d < K; d++) {
+                if ((n.min[d] > max[d]) || (n.max[d] < min[d])) {
+                    return;
+                }
+                if ((n.min[d] < min[d]) || (n.max[d] > max[d])) {
+                    contained = false;
+                }
+            }
+
+            if (contained) {
+                fn(n, true);
+            } else if (!n.child_count) {
+                fn(n, false);
+            } else {
+                for (uint32_t c = 0; c < n.child_count; c++) {
+                    box_nodes(n.first_child + c, min, max, fn);
+                }
+            }
+        }
+
+        template<typename Queue>
+        void knn_step(knn_search<Queue> &search, uint32_t index) const
+        {
+            const node &n = nodes[index];
+
+            if (!n.child_count) {
+                for (uint32_t i = n.begin; i < n.end; i++) {
+                    vector diff = search.position - order.positions[i];
+                    search.queue.offer(order.indices[i], diff.dot(diff));
+                }
+
+                if (search.leaf_visits_left) {
+                    search.leaf_visits_left--;
+                }
+                return;
+            }
+
+            // Visit the children nearest first, so the bound shrinks quickly
+            struct child_dist {
+                uint32_t index;
+                float sq_dist;
+            } children[CHILDREN];
+
+            for (uint32_t c = 0; c < n.child_count; c++) {
+                children[c].index = n.first_child + c;
+                children[c].sq_dist = sq_dist_to_node(search.position, nodes[n.first_child + c]);
+
+                for (uint32_t j = c; (j > 0) && (children[j - 1].sq_dist > children[j].sq_dist); j--) {
+                    std::swap(children[j - 1], children[j]);
+                }
+            }
+
+            for (uint32_t c = 0; c < n.child_count; c++) {
+                if (search.done()) {
+                    return;
+                }
+
+                if (search.queue.full() && (children[c].sq_dist * search.prune_scale >= search.queue.bound())) {
+                    // The rest is even farther away
+                    return;
+                }
+
+                knn_step(search, children[c].index);
+            }
+        }
+
+        template<typename Queue>
+        unsigned knn_collect(const vector &position, unsigned neighbors, uint32_t *indices, float *sq_dists,
+                             const knn_approximation &approx) const
+        {
+            knn_search<Queue> search(position, neighbors, approx);
+
+            if (!nodes.empty()) {
+                knn_step(search, 0);
+            }
+
+            return spatial_index<K>::store_results(search.queue, neighbors, indices, sq_dists);
+        }
+};
+
+#endif
@@ -0,0 +1,172 @@
+#ifndef PARALLEL_HPP
+#define PARALLEL_HPP
+
+#include <algorithm>
+#include <atomic>
+#include <cstddef>
+#include <functional>
+#include <thread>
+#include <vector>
+
+
+static inline int worker_count(void)
+{
+    int count = std::thread::hardware_concurrency();
+    return count > 0 ? count : 1;
+}
+
+
+// Calls fn(begin, end) for consecutive chunks of [0, count) on all cores.
+// Chunks are handed out on demand, so uneven work per item is fine. Worker 0
+// is the calling thread itself; it reports the number of items handed out so
+// far to progress after every chunk it has finished, which makes it safe to
+// call the (Qt-based) progress functions from there. thread_count limits the
+// number of threads used (0 means one per core).
+template<typename F>
+void parallel_for(size_t count, size_t chunk_size, F fn,
+                  const std::function<void(size_t)> &progress = std::function<void(size_t)>(),
+                  int thread_count = 0)
+{
+    std::atomic<size_t> next(0);
+
+    if (thread_count <= 0) {
+        thread_count = worker_count();
+    }
+
+    if (!chunk_size) {
+        chunk_size = 1;
+    }
+
+    auto worker = [&](int thread_index) {
+        for (;;) {
+            size_t begin = next.fetch_add(chunk_size);
+            if (begin >= count) {
+                break;
+            }
+
+            fn(begin, std::min(begin + chunk_size, count));
+
+            if (!thread_index && progress) {
+                progress(std::min(next.load(), count));
+            }
+        }
+    };
+
+    std::vector<std::thread> threads;
+    threads.reserve(thread_count - 1);
+    for (int i = 1; i < thread_count; i++) {
+        threads.emplace_back(worker, i);
+    }
+
+    worker(0);
+
+    for (std::thread &t: threads) {
+        t.join();
+    }
+}
+
+
+// std::sort() on all cores: every thread sorts a part of its own, then the
+// parts are merged pairwise (each merge round again on all cores)
+template<typename T, typename Compare>
+void parallel_sort(std::vector<T> &v, Compare cmp)
+{
+    enum {
+        // Below this, the threads cost more than they bring
+        PARALLEL_SORT_THRESHOLD = 65536
+    };
+
+    size_t parts = worker_count();
+    if ((parts < 2) || (v.size() < PARALLEL_SORT_THRESHOLD)) {
+        std::sort(v.begin(), v.end(), cmp);
+        return;
+    }
+
+    size_t part_size = (v.size() + parts - 1) / parts;
+    parallel_for(v.size(), part_size, [&](size_t begin, size_t end) {
+        std::sort(v.begin() + begin, v.begin() + end, cmp);
+    });
+
+    for (size_t width = part_size; width < v.size(); width *= 2) {
+        size_t pairs = (v.size() + 2 * width - 1) / (2 * width);
+
+        parallel_for(pairs, 1, [&](size_t begin, size_t end) {
+            for (size_t pair = begin; pair < end; pair++) {
+                size_t lo  = pair * 2 * width;
+                size_t mid = std::min(lo + width, v.size());
+                size_t hi  = std::min(lo + 2 * width, v.size());
+
+                if (mid < hi) {
+                    std::inplace_merge(v.begin() + lo, v.begin() + mid, v.begin() + hi, cmp);
+                }
+            }
+        });
+    }
+}
+
+
+// Stable sort of v ascending by key(element), an unsigned integer of which only
+// the lowest key_bits bits are used, on all cores: a least significant digit
+// radix sort, so it takes linear time. Every chunk counts the digits of its
+// elements and scatters them on its own; digits which are the same for all
+// elements (e.g. the upper bits of small indices) are skipped.
+template<typename T, typename KeyFn>
+void parallel_radix_sort(std::vector<T> &v, KeyFn key, unsigned key_bits)
+{
+    enum {
+        RADIX_BITS = 8,
+        RADIX = 1 << RADIX_BITS,
+        RADIX_CHUNK_SIZE = 65536
+    };
+
+    size_t count = v.size();
+    size_t chunks = (count + RADIX_CHUNK_SIZE - 1) / RADIX_CHUNK_SIZE;
+
+    std::vector<T> sorted(count);
+    // Digit counts per chunk, which become the chunks' starting offsets per
+    // digit in the sorted vector
+    std::vector<size_t> offsets(chunks * RADIX);
+
+    for (unsigned shift = 0; shift < key_bits; shift += RADIX_BITS) {
+        parallel_for(count, RADIX_CHUNK_SIZE, [&](size_t begin, size_t end) {
+            size_t *hist = &offsets[begin / RADIX_CHUNK_SIZE * RADIX];
+            std::fill(hist, hist + RADIX, 0);
+
+            for (size_t i = begin; i < end; i++) {
+                hist[(key(v[i]) >> shift) & (RADIX - 1)]++;
+            }
+        });
+
+        size_t total = 0;
+        bool trivial = false;
+        for (unsigned digit = 0; digit < RADIX; digit++) {
+            size_t digit_count = 0;
+            for (size_t c = 0; c < chunks; c++) {
+                size_t n = offsets[c * RADIX + digit];
+                offsets[c * RADIX + digit] = total;
+                total += n;
+                digit_count += n;
+            }
+
+            if (digit_count == count) {
+                trivial = true;
+            }
+        }
+
+        if (trivial) {
+            continue;
+        }
+
+        parallel_for(count, RADIX_CHUNK_SIZE, [&](size_t begin, size_t end) {
+            size_t *next = &offsets[begin / RADIX_CHUNK_SIZE * RADIX];
+
+            for (size_t i = begin; i < end; i++) {
+                sorted[next[(key(v[i]) >> shift) & (RADIX - 1)]++] = v[i];
+            }
+        });
+
+        v.swap(sorted);
+    }
+}
+
+#endif
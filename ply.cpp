@@ -0,0 +1,1027 @@
+#include <algorithm>
+#include <atomic>
+#include <cctype>
+#include <cmath>
+#include <cstdint>
+#include <cstring>
+#include <iostream>
+#include <limits>
+#include <locale>
+#include <sstream>
+#include <stdexcept>
+#include <string>
+#include <vector>
+#include <dake/math/matrix.hpp>
+
+#include "parallel.hpp"
+#include "ply.hpp"
+#include "point.hpp"
+
+
+using namespace dake::math;
+
+
+enum {
+    // Records read or written per block in binary files
+    BINARY_BLOCK_RECORDS = 65536,
+    // Records converted per thread at a time within a block
+    BINARY_CHUNK_RECORDS = 4096
+};
+
+
+static bool crlf_getline(std::istream &s, std::string &str)
+{
+    if (!std::getline(s, str))
+        return false;
+
+    if (!str.empty() && (str.back() == '\r'))
+        str.pop_back();
+
+    return true;
+}
+
+
+static bool host_is_big_endian(void)
+{
+    uint16_t probe = 1;
+    unsigned char first;
+    memcpy(&first, &probe, 1);
+    return !first;
+}
+
+
+static bool needs_swap(ply_format format)
+{
+    return (format == ply_format::BINARY_BIG_ENDIAN) != host_is_big_endian();
+}
+
+
+static ply_property::type_type parse_type(const std::string &name)
+{
+    if ((name == "char")   || (name == "int8"))    return ply_property::CHAR;
+    if ((name == "uchar")  || (name == "uint8"))   return ply_property::UCHAR;
+    if ((name == "short")  || (name == "int16"))   return ply_property::SHORT;
+    if ((name == "ushort") || (name == "uint16"))  return ply_property::USHORT;
+    if ((name == "int")    || (name == "int32"))   return ply_property::INT;
+    if ((name == "uint")   || (name == "uint32"))  return ply_property::UINT;
+    if ((name == "float")  || (name == "float32")) return ply_property::FLOAT;
+    if ((name == "double") || (name == "float64")) return ply_property::DOUBLE;
+
+    throw std::invalid_argument("Unknown property type");
+}
+
+
+static ply_property::field_type parse_field(const std::string &name)
+{
+    if (name == "x")     return ply_property::X;
+    if (name == "y")     return ply_property::Y;
+    if (name == "z")     return ply_property::Z;
+    if (name == "nx")    return ply_property::NX;
+    if (name == "ny")    return ply_property::NY;
+    if (name == "nz")    return ply_property::NZ;
+    if (name == "red")   return ply_property::RED;
+    if (name == "green") return ply_property::GREEN;
+    if (name == "blue")  return ply_property::BLUE;
+
+    return ply_property::UNUSED;
+}
+
+
+size_t ply_property::type_size(type_type t)
+{
+    switch (t) {
+        case CHAR:   case UCHAR:  return 1;
+        case SHORT:  case USHORT: return 2;
+        case INT:    case UINT:   case FLOAT: return 4;
+        case DOUBLE: return 8;
+    }
+
+    return 0;
+}
+
+
+size_t ply_element::record_size(void) const
+{
+    size_t size = 0;
+    for (const ply_property &prop: properties) {
+        if (prop.list) {
+            return 0;
+        }
+        size += ply_property::type_size(prop.type);
+    }
+    return size;
+}
+
+
+ply_header read_ply_header(std::istream &s)
+{
+    std::string line;
+    ply_header header;
+    bool have_format = false;
+
+
+    crlf_getline(s, line);
+    if (line != "ply")
+        throw std::invalid_argument("File is not in PLY format");
+
+    for (;;) {
+        if (!crlf_getline(s, line))
+            throw std::invalid_argument("Unexpected EOF in header");
+
+        if (line.empty())
+            continue;
+
+        std::stringstream line_ss(line);
+
+        std::string cmd;
+        line_ss >> cmd;
+
+        if (cmd == "format") {
+            std::string ftype;
+            line_ss >> ftype;
+            if (ftype == "ascii") {
+                header.format = ply_format::ASCII;
+            } else if (ftype == "binary_little_endian") {
+                header.format = ply_format::BINARY_LITTLE_ENDIAN;
+            } else if (ftype == "binary_big_endian") {
+                header.format = ply_format::BINARY_BIG_ENDIAN;
+            } else {
+                throw std::invalid_argument("Unknown PLY format");
+            }
+
+            float fver;
+            line_ss >> fver;
+            if (fver != 1.f)
+                throw std::invalid_argument("Invalid PLY version");
+
+            have_format = true;
+        } else if (cmd == "element") {
+            ply_element element;
+            long long count = -1;
+
+            line_ss >> element.name >> count;
+            if (count < 0)
+                throw std::invalid_argument("Element count negative or missing");
+
+            element.count = count;
+            header.elements.push_back(element);
+        } else if (cmd == "property") {
+            if (header.elements.empty())
+                throw std::invalid_argument("property misplaced (no element found yet)");
+
+            ply_property prop;
+
+            std::string type;
+            line_ss >> type;
+            if (type == "list") {
+                std::string count_type;
+                line_ss >> count_type >> type;
+
+                prop.list = true;
+                prop.count_type = parse_type(count_type);
+            } else {
+                prop.list = false;
+                prop.count_type = ply_property::UCHAR;
+            }
+            prop.type = parse_type(type);
+
+            line_ss >> prop.name;
+            // Lists cannot go into a point
+            prop.field = prop.list ? ply_property::UNUSED : parse_field(prop.name);
+
+            header.elements.back().properties.push_back(prop);
+        } else if (cmd == "end_header") {
+            break;
+        } else if ((cmd == "comment") || (cmd == "obj_info")) {
+            continue;
+        } else {
+            throw std::invalid_argument("Unknown header command");
+        }
+    }
+
+    if (!have_format)
+        throw std::invalid_argument("Format unspecified");
+
+    return header;
+}
+
+
+ply_header read_ply_header(const char *data, size_t size, size_t &header_size)
+{
+    const char *end = data + size;
+
+    // Do not go looking for end_header through some huge non-PLY file
+    if ((size < 3) || memcmp(data, "ply", 3) || ((size > 3) && (data[3] != '\n') && (data[3] != '\r')))
+        throw std::invalid_argument("File is not in PLY format");
+
+    const char *ptr = data;
+    for (;;) {
+        const char *newline = static_cast<const char *>(memchr(ptr, '\n', end - ptr));
+        if (!newline)
+            throw std::invalid_argument("Unexpected EOF in header");
+
+        std::string line(ptr, newline);
+        ptr = newline + 1;
+
+        std::string cmd;
+        std::istringstream(line) >> cmd;
+        if (cmd == "end_header") {
+            break;
+        }
+    }
+
+    header_size = ptr - data;
+
+    std::istringstream s(std::string(data, header_size));
+    return read_ply_header(s);
+}
+
+
+void write_ply_header(std::ostream &s, ply_format format, size_t vertices)
+{
+    s << "ply\n";
+    switch (format) {
+        case ply_format::ASCII:                s << "format ascii 1.0\n"; break;
+        case ply_format::BINARY_LITTLE_ENDIAN: s << "format binary_little_endian 1.0\n"; break;
+        case ply_format::BINARY_BIG_ENDIAN:    s << "format binary_big_endian 1.0\n"; break;
+    }
+    s << "element vertex " << vertices << "\n";
+    s << "property float x\n";
+    s << "property float y\n";
+    s << "property float z\n";
+    s << "property float nx\n";
+    s << "property float ny\n";
+    s << "property float nz\n";
+    s << "property uchar red\n";
+    s << "property uchar green\n";
+    s << "property uchar blue\n";
+    s << "end_header\n";
+}
+
+
+float ply_value(const ply_property &prop, double value)
+{
+    if ((prop.field != ply_property::RED) && (prop.field != ply_property::GREEN) && (prop.field != ply_property::BLUE)) {
+        return value;
+    }
+
+    switch (prop.type) {
+        case ply_property::CHAR:   return value / std::numeric_limits<int8_t>::max();
+        case ply_property::UCHAR:  return value / std::numeric_limits<uint8_t>::max();
+        case ply_property::SHORT:  return value / std::numeric_limits<int16_t>::max();
+        case ply_property::USHORT: return value / std::numeric_limits<uint16_t>::max();
+        case ply_property::INT:    return value / std::numeric_limits<int32_t>::max();
+        case ply_property::UINT:   return value / std::numeric_limits<uint32_t>::max();
+        case ply_property::FLOAT:
+        case ply_property::DOUBLE: return value;
+    }
+
+    return value;
+}
+
+
+template<typename T>
+static T load_raw(const unsigned char *ptr, bool swap)
+{
+    unsigned char bytes[sizeof(T)];
+    memcpy(bytes, ptr, sizeof(T));
+    if (swap) {
+        std::reverse(bytes, bytes + sizeof(T));
+    }
+
+    T value;
+    memcpy(&value, bytes, sizeof(T));
+    return value;
+}
+
+
+static double load_value(const unsigned char *ptr, ply_property::type_type type, bool swap)
+{
+    switch (type) {
+        case ply_property::CHAR:   return load_raw<int8_t>(ptr, swap);
+        case ply_property::UCHAR:  return load_raw<uint8_t>(ptr, swap);
+        case ply_property::SHORT:  return load_raw<int16_t>(ptr, swap);
+        case ply_property::USHORT: return load_raw<uint16_t>(ptr, swap);
+        case ply_property::INT:    return load_raw<int32_t>(ptr, swap);
+        case ply_property::UINT:   return load_raw<uint32_t>(ptr, swap);
+        case ply_property::FLOAT:  return load_raw<float>(ptr, swap);
+        case ply_property::DOUBLE: return load_raw<double>(ptr, swap);
+    }
+
+    return 0.;
+}
+
+
+static void set_field(point &pt, ply_property::field_type field, float value)
+{
+    switch (field) {
+        case ply_property::X:     pt.position.x() = value; break;
+        case ply_property::Y:     pt.position.y() = value; break;
+        case ply_property::Z:     pt.position.z() = value; break;
+        case ply_property::NX:    pt.normal.x()   = value; break;
+        case ply_property::NY:    pt.normal.y()   = value; break;
+        case ply_property::NZ:    pt.normal.z()   = value; break;
+        case ply_property::RED:   pt.color.r()    = value; break;
+        case ply_property::GREEN: pt.color.g()    = value; break;
+        case ply_property::BLUE:  pt.color.b()    = value; break;
+        case ply_property::UNUSED: break;
+    }
+}
+
+
+static void init_point(point &pt)
+{
+    pt.position = vec3::zero();
+    pt.normal   = vec3::zero();
+    pt.color    = vec3(1.f, 1.f, 1.f);
+    pt.curvature = 0.f;
+}
+
+
+static const char *skip_lines(const char *data, const char *end, size_t count)
+{
+    for (size_t i = 0; i < count; i++) {
+        const char *newline = static_cast<const char *>(memchr(data, '\n', end - data));
+        if (!newline) {
+            // The last line does not need a line break
+            if ((i + 1 == count) && (data < end)) {
+                return end;
+            }
+            throw std::invalid_argument("Unexpected EOF");
+        }
+        data = newline + 1;
+    }
+
+    return data;
+}
+
+
+static const char *skip_binary_element(const char *data, const char *end, ply_format format, const ply_element &element)
+{
+    size_t record_size = element.record_size();
+    if (record_size) {
+        if (element.count > static_cast<size_t>(end - data) / record_size)
+            throw std::invalid_argument("Unexpected EOF");
+        return data + record_size * element.count;
+    }
+
+    // Lists have to be gone through one by one
+    bool swap = needs_swap(format);
+
+    for (size_t i = 0; i < element.count; i++) {
+        for (const ply_property &prop: element.properties) {
+            size_t count = 1;
+
+            if (prop.list) {
+                size_t count_size = ply_property::type_size(prop.count_type);
+                if (count_size > static_cast<size_t>(end - data))
+                    throw std::invalid_argument("Unexpected EOF");
+
+                double list_length = load_value(reinterpret_cast<const unsigned char *>(data), prop.count_type, swap);
+                if (list_length < 0)
+                    throw std::invalid_argument("List length negative");
+
+                data += count_size;
+                count = list_length;
+            }
+
+            if (count > static_cast<size_t>(end - data) / ply_property::type_size(prop.type))
+                throw std::invalid_argument("Unexpected EOF");
+            data += count * ply_property::type_size(prop.type);
+        }
+    }
+
+    return data;
+}
+
+
+static void read_binary_vertices(const char *data, const char *end, ply_format format, const ply_element &element,
+                                 point *points)
+{
+    size_t record_size = element.record_size();
+    if (!record_size)
+        throw std::invalid_argument("List properties in vertices are not supported");
+
+    if (element.count > static_cast<size_t>(end - data) / record_size)
+        throw std::invalid_argument("Unexpected EOF");
+
+    // Only what actually goes somewhere is decoded
+    struct field_source {
+        size_t offset;
+        const ply_property *prop;
+    };
+    std::vector<field_source> sources;
+
+    size_t offset = 0;
+    for (const ply_property &prop: element.properties) {
+        if (prop.field != ply_property::UNUSED) {
+            sources.push_back(field_source{offset, &prop});
+        }
+        offset += ply_property::type_size(prop.type);
+    }
+
+    bool swap = needs_swap(format);
+    const unsigned char *records = reinterpret_cast<const unsigned char *>(data);
+
+    parallel_for(element.count, BINARY_CHUNK_RECORDS, [&](size_t begin, size_t end_record) {
+        for (size_t i = begin; i < end_record; i++) {
+            const unsigned char *record = records + i * record_size;
+            point &pt = points[i];
+
+            init_point(pt);
+            for (const field_source &src: sources) {
+                set_field(pt, src.prop->field, ply_value(*src.prop, load_value(record + src.offset, src.prop->type, swap)));
+            }
+        }
+    });
+}
+
+
+static const double powers_of_ten[] = {
+    1e0,  1e1,  1e2,  1e3,  1e4,  1e5,  1e6,  1e7,  1e8,  1e9,  1e10, 1e11,
+    1e12, 1e13, 1e14, 1e15, 1e16, 1e17, 1e18, 1e19, 1e20, 1e21, 1e22
+};
+
+// Converts mantissa * 10^exponent to a double if that can be done exactly with
+// a single floating-point operation (both factors are exact doubles then), so
+// the result is correctly rounded
+static bool exact_decimal(uint64_t mantissa, int exponent, double &result)
+{
+    if (!mantissa) {
+        result = 0.;
+        return true;
+    }
+
+    if ((mantissa > (UINT64_C(1) << 53)) || (exponent < -22) || (exponent > 22)) {
+        return false;
+    }
+
+    result = exponent < 0 ? mantissa / powers_of_ten[-exponent] : mantissa * powers_of_ten[exponent];
+    return true;
+}
+
+// Rounding a (correctly rounded) double to a float once more is only wrong if
+// it is right between two floats
+static bool exact_as_float(double value)
+{
+    float f = value;
+    if (f == value) {
+        return true;
+    }
+
+    float other = std::nextafter(f, value > f ? HUGE_VALF : -HUGE_VALF);
+    return value - f != other - value;
+}
+
+
+static bool is_blank(char c)
+{
+    return (c == ' ') || (c == '\t') || (c == '\r');
+}
+
+
+// Skips word at s (ignoring case) if it is there
+static bool skip_word(const char *&s, const char *end, const char *word)
+{
+    const char *t = s;
+    for (; *word; word++, t++) {
+        if ((t >= end) || (tolower(static_cast<unsigned char>(*t)) != *word)) {
+            return false;
+        }
+    }
+
+    s = t;
+    return true;
+}
+
+
+// Parses the number at ptr (after skipping blanks) into value and moves ptr
+// behind it; returns false if there is no valid number. nan and [-]inf are
+// taken, too, as format_float() writes those. Decimals with up to 19
+// significant digits and small exponents are converted by exact_decimal();
+// anything else, and doubles which would round differently as floats (than
+// the decimal itself would), goes through an std::istringstream, which is slow
+// but always right.
+static bool parse_number(const char *&ptr, const char *end, bool as_double, double &value)
+{
+    const char *s = ptr;
+    while ((s < end) && is_blank(*s)) {
+        s++;
+    }
+
+    const char *start = s;
+    bool negative = false;
+    if ((s < end) && ((*s == '-') || (*s == '+'))) {
+        negative = *s == '-';
+        s++;
+    }
+
+    if ((s < end) && ((*s == 'n') || (*s == 'N') || (*s == 'i') || (*s == 'I'))) {
+        double special;
+        if (skip_word(s, end, "nan")) {
+            special = NAN;
+        } else if (skip_word(s, end, "infinity") || skip_word(s, end, "inf")) {
+            special = HUGE_VAL;
+        } else {
+            return false;
+        }
+
+        if ((s < end) && !is_blank(*s) && (*s != '\n')) {
+            return false;
+        }
+
+        value = negative ? -special : special;
+        ptr = s;
+        return true;
+    }
+
+    uint64_t mantissa = 0;
+    int digits = 0, exponent = 0;
+    bool any_digits = false, truncated = false;
+
+    for (; (s < end) && (*s >= '0') && (*s <= '9'); s++) {
+        any_digits = true;
+        if (digits < 19) {
+            mantissa = mantissa * 10 + (*s - '0');
+            digits += mantissa != 0;
+        } else {
+            truncated |= *s != '0';
+            exponent++;
+        }
+    }
+
+    if ((s < end) && (*s == '.')) {
+        for (s++; (s < end) && (*s >= '0') && (*s <= '9'); s++) {
+            any_digits = true;
+            if (digits < 19) {
+                mantissa = mantissa * 10 + (*s - '0');
+                digits += mantissa != 0;
+                exponent--;
+            } else {
+                truncated |= *s != '0';
+            }
+        }
+    }
+
+    if (!any_digits) {
+        return false;
+    }
+
+    if ((s < end) && ((*s == 'e') || (*s == 'E'))) {
+        s++;
+
+        bool negative_exp = false;
+        if ((s < end) && ((*s == '-') || (*s == '+'))) {
+            negative_exp = *s == '-';
+            s++;
+        }
+
+        if ((s >= end) || (*s < '0') || (*s > '9')) {
+            return false;
+        }
+
+        int exp = 0;
+        for (; (s < end) && (*s >= '0') && (*s <= '9'); s++) {
+            if (exp < 100000) {
+                exp = exp * 10 + (*s - '0');
+            }
+        }
+        exponent += negative_exp ? -exp : exp;
+    }
+
+    if ((s < end) && !is_blank(*s) && (*s != '\n')) {
+        return false;
+    }
+
+    double result;
+    bool exact = !truncated && exact_decimal(mantissa, exponent, result) && (as_double || exact_as_float(result));
+
+    if (!exact) {
+        std::istringstream ss(std::string(start, s));
+        ss.imbue(std::locale::classic());
+
+        if (as_double) {
+            ss >> value;
+        } else {
+            float f;
+            ss >> f;
+            value = f;
+        }
+
+        if (ss.fail()) {
+            return false;
+        }
+    } else {
+        value = negative ? -result : result;
+    }
+
+    ptr = s;
+    return true;
+}
+
+
+static bool parse_vertex_line(const char *line, const char *end, const std::vector<ply_property> &properties, point &pt)
+{
+    init_point(pt);
+
+    for (const ply_property &prop: properties) {
+        double value;
+
+        if (prop.list) {
+            if (!parse_number(line, end, true, value) || !(value >= 0) || std::isinf(value)) {
+                return false;
+            }
+
+            for (size_t i = 0, n = value; i < n; i++) {
+                if (!parse_number(line, end, true, value)) {
+                    return false;
+                }
+            }
+            continue;
+        }
+
+        if (!parse_number(line, end, prop.type == ply_property::DOUBLE, value)) {
+            return false;
+        }
+
+        set_field(pt, prop.field, ply_value(prop, value));
+    }
+
+    return true;
+}
+
+
+static void read_ascii_vertices(const char *data, const char *end, const ply_element &element, point *points)
+{
+    enum {
+        // The data is split into chunks of (about) this size at line breaks
+        ASCII_CHUNK_BYTES = 1 << 22
+    };
+
+    std::vector<const char *> bounds(1, data);
+    while (bounds.back() < end) {
+        const char *next = bounds.back() + std::min<size_t>(ASCII_CHUNK_BYTES, end - bounds.back());
+        if (next < end) {
+            next = static_cast<const char *>(memchr(next, '\n', end - next));
+            next = next ? next + 1 : end;
+        }
+        bounds.push_back(next);
+    }
+    size_t chunks = bounds.size() - 1;
+
+    // Count the lines per chunk first, so every chunk knows which vertex its
+    // first line is
+    std::vector<size_t> first_line(chunks + 1);
+    parallel_for(chunks, 1, [&](size_t begin, size_t end_chunk) {
+        for (size_t c = begin; c < end_chunk; c++) {
+            size_t lines = std::count(bounds[c], bounds[c + 1], '\n');
+            // A last line without line break
+            if ((bounds[c + 1] == end) && (bounds[c + 1][-1] != '\n')) {
+                lines++;
+            }
+            first_line[c + 1] = lines;
+        }
+    });
+
+    first_line[0] = 0;
+    for (size_t c = 0; c < chunks; c++) {
+        first_line[c + 1] += first_line[c];
+    }
+
+    if (first_line[chunks] < element.count)
+        throw std::invalid_argument("Unexpected EOF");
+
+    std::atomic<bool> malformed(false);
+
+    parallel_for(chunks, 1, [&](size_t begin, size_t end_chunk) {
+        for (size_t c = begin; c < end_chunk; c++) {
+            const char *line = bounds[c];
+
+            for (size_t i = first_line[c]; (i < element.count) && (line < bounds[c + 1]); i++) {
+                const char *line_end = static_cast<const char *>(memchr(line, '\n', bounds[c + 1] - line));
+                if (!line_end) {
+                    line_end = bounds[c + 1];
+                }
+
+                if (!parse_vertex_line(line, line_end, element.properties, points[i])) {
+                    malformed.store(true, std::memory_order_relaxed);
+                }
+
+                line = line_end + 1;
+            }
+        }
+    });
+
+    if (malformed.load())
+        throw std::invalid_argument("Malformed vertex data");
+}
+
+
+void read_ply_vertices(const char *data, const char *end, const ply_header &header, std::vector<point> &points)
+{
+    // Everything up to the vertices has to be skipped, everything after that
+    // is of no interest
+    auto vertex_element = header.elements.begin();
+    for (; vertex_element != header.elements.end(); ++vertex_element) {
+        if (vertex_element->name == "vertex") {
+            break;
+        }
+
+        if (header.format == ply_format::ASCII) {
+            data = skip_lines(data, end, vertex_element->count);
+        } else {
+            data = skip_binary_element(data, end, header.format, *vertex_element);
+        }
+    }
+
+    if (vertex_element == header.elements.end())
+        throw std::invalid_argument("Vertex count unspecified");
+
+    if (vertex_element->properties.empty())
+        throw std::invalid_argument("Properties unspecified");
+
+    // Don't trust the count with an allocation before it has been checked
+    // against the data; every ASCII line takes at least one byte
+    size_t available = end - data;
+    if (header.format == ply_format::ASCII) {
+        if (vertex_element->count > available)
+            throw std::invalid_argument("Unexpected EOF");
+    } else {
+        size_t record_size = vertex_element->record_size();
+        if (!record_size)
+            throw std::invalid_argument("List properties in vertices are not supported");
+
+        if (vertex_element->count > available / record_size)
+            throw std::invalid_argument("Unexpected EOF");
+    }
+
+    size_t first = points.size();
+    points.resize(first + vertex_element->count);
+
+    try {
+        if (header.format == ply_format::ASCII) {
+            read_ascii_vertices(data, end, *vertex_element, points.data() + first);
+        } else {
+            read_binary_vertices(data, end, header.format, *vertex_element, points.data() + first);
+        }
+    } catch (...) {
+        points.resize(first);
+        throw;
+    }
+}
+
+
+// Rounded, so colors which have been loaded from a file are stored unchanged
+static unsigned color_value(float c)
+{
+    return std::min(std::max(lrintf(c * 255.f), 0L), 255L);
+}
+
+
+void write_ply_binary_vertices(std::ostream &s, ply_format format, const std::vector<point> &points)
+{
+    enum {
+        // Six floats and three uchars, see write_ply_header()
+        RECORD_SIZE = 6 * sizeof(float) + 3
+    };
+
+    bool swap = needs_swap(format);
+
+    std::vector<unsigned char> block;
+    for (size_t done = 0; done < points.size(); done += BINARY_BLOCK_RECORDS) {
+        size_t records = std::min<size_t>(BINARY_BLOCK_RECORDS, points.size() - done);
+        block.resize(records * RECORD_SIZE);
+
+        parallel_for(records, BINARY_CHUNK_RECORDS, [&](size_t begin, size_t end) {
+            for (size_t i = begin; i < end; i++) {
+                const point &pt = points[done + i];
+                unsigned char *record = block.data() + i * RECORD_SIZE;
+
+                float coords[6] = {
+                    pt.position.x(), pt.position.y(), pt.position.z(),
+                    pt.normal.x(), pt.normal.y(), pt.normal.z()
+                };
+                memcpy(record, coords, sizeof(coords));
+
+                if (swap) {
+                    for (int j = 0; j < 6; j++) {
+                        std::reverse(record + j * sizeof(float), record + (j + 1) * sizeof(float));
+                    }
+                }
+
+                for (int j = 0; j < 3; j++) {
+                    record[sizeof(coords) + j] = color_value(pt.color[j]);
+                }
+            }
+        });
+
+        s.write(reinterpret_cast<const char *>(block.data()), block.size());
+    }
+}
+
+
+static char *format_uint(char *out, unsigned value)
+{
+    char digits[10];
+    int count = 0;
+
+    do {
+        digits[count++] = '0' + value % 10;
+        value /= 10;
+    } while (value);
+
+    while (count) {
+        *out++ = digits[--count];
+    }
+    return out;
+}
+
+
+static double power_of_ten(int exponent)
+{
+    if ((exponent >= 0) && (exponent <= 22)) {
+        return powers_of_ten[exponent];
+    } else if ((exponent < 0) && (exponent >= -22)) {
+        return 1. / powers_of_ten[-exponent];
+    }
+    return pow(10., exponent);
+}
+
+
+// mantissa * 10^exponent as parse_number() reads it
+static float decimal_to_float(uint64_t mantissa, int exponent)
+{
+    double value;
+    if (exact_decimal(mantissa, exponent, value) && exact_as_float(value)) {
+        return value;
+    }
+
+    std::ostringstream decimal;
+    decimal.imbue(std::locale::classic());
+    decimal << mantissa << 'e' << exponent;
+
+    std::istringstream ss(decimal.str());
+    ss.imbue(std::locale::classic());
+
+    // Out of range is an error (even though f is set to the maximum then)
+    float f;
+    ss >> f;
+    return ss.fail() ? NAN : f;
+}
+
+
+// Writes the shortest decimal which reads back as exactly the given float (at
+// most nine digits). Independent of the locale, unlike printf().
+static char *format_float(char *out, float value)
+{
+    if (std::isnan(value)) {
+        memcpy(out, "nan", 3);
+        return out + 3;
+    }
+
+    if (std::signbit(value)) {
+        *out++ = '-';
+        value = -value;
+    }
+
+    if (std::isinf(value)) {
+        memcpy(out, "inf", 3);
+        return out + 3;
+    } else if (!value) {
+        *out++ = '0';
+        return out;
+    }
+
+    // Decimal exponent of the first digit
+    int magnitude = floor(log10(value));
+    if (value < power_of_ten(magnitude)) {
+        magnitude--;
+    } else if (value >= power_of_ten(magnitude + 1)) {
+        magnitude++;
+    }
+
+    auto round_to = [&](int digits, int &exp) {
+        exp = magnitude - digits + 1;
+        return static_cast<uint64_t>(llround(exp < 0 ? value * power_of_ten(-exp) : value / power_of_ten(exp)));
+    };
+
+    // Any decimal with fewer digits is one with more digits, too, so if some
+    // precision reads back correctly, all higher ones do as well; bisect for
+    // the lowest (nine digits always do)
+    int lo = 1, hi = 9;
+    while (lo < hi) {
+        int mid = (lo + hi) / 2, exp;
+        uint64_t digits = round_to(mid, exp);
+        if (decimal_to_float(digits, exp) == value) {
+            hi = mid;
+        } else {
+            lo = mid + 1;
+        }
+    }
+
+    int precision = lo, exponent;
+    uint64_t mantissa = round_to(precision, exponent);
+
+    // Rounding may have carried over into another digit
+    if (mantissa >= static_cast<uint64_t>(powers_of_ten[precision])) {
+        mantissa /= 10;
+        exponent++;
+    }
+    while ((precision > 1) && !(mantissa % 10)) {
+        mantissa /= 10;
+        exponent++;
+        precision--;
+    }
+
+    char digits[9];
+    for (int i = precision - 1; i >= 0; i--) {
+        digits[i] = '0' + mantissa % 10;
+        mantissa /= 10;
+    }
+
+    int point_pos = exponent + precision;
+    if ((point_pos > 9) || (point_pos < -4)) {
+        *out++ = digits[0];
+        if (precision > 1) {
+            *out++ = '.';
+            memcpy(out, digits + 1, precision - 1);
+            out += precision - 1;
+        }
+
+        int exp10 = point_pos - 1;
+        *out++ = 'e';
+        *out++ = exp10 < 0 ? '-' : '+';
+        return format_uint(out, exp10 < 0 ? -exp10 : exp10);
+    } else if (point_pos <= 0) {
+        *out++ = '0';
+        *out++ = '.';
+        memset(out, '0', -point_pos);
+        out += -point_pos;
+        memcpy(out, digits, precision);
+        return out + precision;
+    } else if (point_pos >= precision) {
+        memcpy(out, digits, precision);
+        out += precision;
+        memset(out, '0', point_pos - precision);
+        return out + point_pos - precision;
+    } else {
+        memcpy(out, digits, point_pos);
+        out += point_pos;
+        *out++ = '.';
+        memcpy(out, digits + point_pos, precision - point_pos);
+        return out + precision - point_pos;
+    }
+}
+
+
+void write_ply_ascii_vertices(std::ostream &s, const std::vector<point> &points)
+{
+    enum {
+        // Vertices formatted into one buffer
+        ASCII_CHUNK_RECORDS = 16384,
+        // Enough for six floats, three colors and separators
+        MAX_RECORD_LENGTH = 6 * 24 + 3 * 4 + 9
+    };
+
+    size_t chunks = (points.size() + ASCII_CHUNK_RECORDS - 1) / ASCII_CHUNK_RECORDS;
+    size_t batch = 4 * worker_count();
+
+    std::vector<std::vector<char>> buffers(batch);
+    std::vector<size_t> lengths(batch);
+
+    // Format a batch of chunks on all cores, then write them in order
+    for (size_t first = 0; first < chunks; first += batch) {
+        size_t count = std::min(batch, chunks - first);
+
+        parallel_for(count, 1, [&](size_t begin, size_t end) {
+            for (size_t b = begin; b < end; b++) {
+                size_t chunk = first + b;
+                size_t from = chunk * ASCII_CHUNK_RECORDS;
+                size_t to = std::min<size_t>(from + ASCII_CHUNK_RECORDS, points.size());
+
+                buffers[b].resize((to - from) * MAX_RECORD_LENGTH);
+                char *out = buffers[b].data();
+
+                for (size_t i = from; i < to; i++) {
+                    const point &pt = points[i];
+
+                    out = format_float(out, pt.position.x()); *out++ = ' ';
+                    out = format_float(out, pt.position.y()); *out++ = ' ';
+                    out = format_float(out, pt.position.z()); *out++ = ' ';
+                    out = format_float(out, pt.normal.x());   *out++ = ' ';
+                    out = format_float(out, pt.normal.y());   *out++ = ' ';
+                    out = format_float(out, pt.normal.z());   *out++ = ' ';
+                    out = format_uint(out, color_value(pt.color.r())); *out++ = ' ';
+                    out = format_uint(out, color_value(pt.color.g())); *out++ = ' ';
+                    out = format_uint(out, color_value(pt.color.b())); *out++ = '\n';
+                }
+
+                lengths[b] = out - buffers[b].data();
+            }
+        });
+
+        for (size_t b = 0; b < count; b++) {
+            s.write(buffers[b].data(), lengths[b]);
+        }
+    }
+}
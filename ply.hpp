@@ -0,0 +1,94 @@
+#ifndef PLY_HPP
+#define PLY_HPP
+
+#include <cstddef>
+#include <iostream>
+#include <string>
+#include <vector>
+
+#include "point.hpp"
+
+
+enum class ply_format {
+    ASCII,
+    BINARY_LITTLE_ENDIAN,
+    BINARY_BIG_ENDIAN
+};
+
+
+struct ply_property {
+    enum type_type {
+        CHAR,
+        UCHAR,
+        SHORT,
+        USHORT,
+        INT,
+        UINT,
+        FLOAT,
+        DOUBLE
+    };
+
+    // The point field a property goes into, if any
+    enum field_type {
+        X, Y, Z,
+        NX, NY, NZ,
+        RED, GREEN, BLUE,
+        UNUSED
+    };
+
+    type_type type;
+    // List properties (like the vertex_indices of faces) are a count of type
+    // count_type, followed by that many values of type type
+    bool list;
+    type_type count_type;
+    std::string name;
+    field_type field;
+
+    static size_t type_size(type_type t);
+};
+
+
+struct ply_element {
+    std::string name;
+    size_t count;
+    std::vector<ply_property> properties;
+
+    // Size of one record in binary files, or 0 if that depends on the lists
+    // in it
+    size_t record_size(void) const;
+};
+
+
+struct ply_header {
+    ply_format format;
+    std::vector<ply_element> elements;
+};
+
+
+// Reads everything up to and including end_header; throws
+// std::invalid_argument for anything which is not a valid PLY header
+ply_header read_ply_header(std::istream &s);
+// Same for a header at the start of a file in memory; header_size is set to
+// its length
+ply_header read_ply_header(const char *data, size_t size, size_t &header_size);
+// Writes the header for the points cloud::store() writes
+void write_ply_header(std::ostream &s, ply_format format, size_t vertices);
+
+// Converts a property value as read from a file: integer color components are
+// scaled to [0, 1] by their type's maximum, everything else is taken as it is
+float ply_value(const ply_property &prop, double value);
+
+// Reads all vertices from the PLY data [data, end) following the header
+// (with elements in front of them being skipped) and appends them to points.
+// ASCII data is split into chunks at line breaks which are parsed on all
+// cores, just like binary records are decoded.
+void read_ply_vertices(const char *data, const char *end, const ply_header &header, std::vector<point> &points);
+// Writes the points as binary records as announced by write_ply_header()
+void write_ply_binary_vertices(std::ostream &s, ply_format format, const std::vector<point> &points);
+// Writes the points as ASCII lines as announced by write_ply_header(). Chunks
+// of them are formatted into buffers on all cores, with every float written as
+// the shortest decimal which reads back as exactly the same float (so storing
+// what has been loaded gives the same file again).
+void write_ply_ascii_vertices(std::ostream &s, const std::vector<point> &points);
+
+#endif
@@ -7,13 +7,16 @@
 struct point {
     point(void) {}
 
-    point(dake::math::vec3 pos, dake::math::vec3 norm, dake::math::vec3 col, float d):
-        position(pos), normal(norm), color(col), density(d)
+    point(dake::math::vec3 pos, dake::math::vec3 norm, dake::math::vec3 col, float d, float curv = 0.f):
+        position(pos), normal(norm), color(col), density(d), curvature(curv)
     {}
 
     dake::math::vec3 position, normal;
     dake::math::vec3 color;
     float density;
+    // Surface variation from normal estimation (smallest eigenvalue of the
+    // neighborhood's covariance over their sum, so 0 on flat ground)
+    float curvature;
 };
 
 #endif
@@ -1,94 +1,298 @@
+#include <algorithm>
+#include <atomic>
 #include <cassert>
 #include <climits>
 #include <cmath>
+#include <cstdint>
+#include <cstring>
 #include <functional>
-#include <thread>
 #include <utility>
 #include <vector>
 
 #include "cloud.hpp"
-#include "kd_tree.hpp"
+#include "knn_graph.hpp"
+#include "parallel.hpp"
+#include "spatial_index.hpp"
 #include "point.hpp"
 #include "rng.hpp"
 #include "window.hpp"
 
 
-rng::rng(cloud &c, int k)
+rng::rng(const cloud &c, int k, spatial_index_type index_type, const knn_approximation &approx)
 {
-    size_t point_count = c.points().size();
-    assert(point_count <= INT_MAX);
+    const std::vector<point> &pts = c.points();
 
-    int thread_count = std::thread::hardware_concurrency();
+    size_t point_count = pts.size();
+    assert(point_count <= INT_MAX);
+    vertices = point_count;
 
     init_progress("RNG (%p %)", point_count);
 
+    const knn_graph &knn_table = c.neighbor_graph(k, approx, index_type, [](size_t done) { announce_progress(done); });
 
-    kd_tree<3> kdt(c, INT_MAX, 10);
+    // Edges are collected as (i << 32 | j) with i < j, so sorting them by
+    // (i, j) is sorting integers. Every chunk of points collects its edges in
+    // a buffer of its own (so there is nothing to be locked).
+    size_t chunks = (point_count + EDGE_CHUNK_SIZE - 1) / EDGE_CHUNK_SIZE;
+    std::vector<std::vector<uint64_t>> chunk_keys(chunks);
 
-    auto rng_thread = [&](int thread_index) {
-        for (int i = thread_index; i < static_cast<int>(point_count); i += thread_count) {
-            std::vector<const point *> knn(kdt.knn(c.points()[i].position, k));
+    parallel_for(point_count, EDGE_CHUNK_SIZE, [&](size_t begin, size_t end) {
+        std::vector<uint64_t> &keys = chunk_keys[begin / EDGE_CHUNK_SIZE];
+        keys.reserve((end - begin) * k);
 
-            for (const point *nn: knn) {
-                // Actually, someone told me this is correct (I had a FIXME
-                // here and thought it to be broken as hell)
-                ptrdiff_t uj = nn - c.points().data();
-                assert((uj >= 0) && (static_cast<size_t>(uj) < point_count) && (&c.points()[uj] == nn));
+        for (size_t i = begin; i < end; i++) {
+            const uint32_t *knn = knn_table.neighbors(i);
+            unsigned found = knn_table.neighbor_count(i, k);
 
-                int j = static_cast<int>(uj);
+            for (unsigned n = 0; n < found; n++) {
+                uint64_t j = knn[n];
 
                 // We don't want loops
                 if (i == j) {
                     continue;
                 }
 
-                // TODO: lock-free
-                edge_mutex.lock();
-                float weight = 1.f - fabs(c.points()[i].normal.dot(nn->normal));
-                if (i < j) {
-                    edge_vector.emplace_back(i, j, weight);
-                } else {
-                    edge_vector.emplace_back(j, i, weight);
-                }
-                edge_mutex.unlock();
-            }
-
-            if (!thread_index) {
-                announce_progress(i + 1);
+                keys.push_back(i < j ? (i << 32) | j : (j << 32) | i);
             }
         }
-    };
+    });
 
-    std::thread *threads[thread_count];
-    for (int i = 0; i < thread_count; i++) {
-        threads[i] = new std::thread(rng_thread, i);
-    }
-    for (int i = 0; i < thread_count; i++) {
-        threads[i]->join();
-        delete threads[i];
+    std::vector<size_t> chunk_offsets(chunks + 1, 0);
+    for (size_t ch = 0; ch < chunks; ch++) {
+        chunk_offsets[ch + 1] = chunk_offsets[ch] + chunk_keys[ch].size();
     }
 
+    std::vector<uint64_t> keys(chunk_offsets[chunks]);
+    parallel_for(chunks, 1, [&](size_t begin, size_t end) {
+        for (size_t ch = begin; ch < end; ch++) {
+            std::copy(chunk_keys[ch].begin(), chunk_keys[ch].end(), keys.begin() + chunk_offsets[ch]);
+            std::vector<uint64_t>().swap(chunk_keys[ch]);
+        }
+    });
 
-    // Remove duplicates by first sorting and then removing consecutive
-    // duplicates
-    std::sort(edge_vector.begin(), edge_vector.end(), [](const edge &e1, const edge &e2) { return (e1.i == e2.i) ? (e1.j < e2.j) : (e1.i < e2.i); });
+    // Edges found from both of their points are next to each other after
+    // sorting
+    parallel_radix_sort(keys, [](uint64_t key) { return key; }, 64);
+    keys.erase(std::unique(keys.begin(), keys.end()), keys.end());
 
-    std::vector<edge> dups_removed;
-    for (auto it = edge_vector.begin(); it != edge_vector.end();) {
-        const edge &e = *it;
-        dups_removed.push_back(e);
+    edge_vector.resize(keys.size());
+    parallel_for(keys.size(), EDGE_CHUNK_SIZE, [&](size_t begin, size_t end) {
+        for (size_t e = begin; e < end; e++) {
+            int i = static_cast<int>(keys[e] >> 32);
+            int j = static_cast<int>(keys[e] & UINT32_MAX);
 
-        do {
-            ++it;
-        } while ((it != edge_vector.end()) && (*it == e));
-    }
-    edge_vector = std::move(dups_removed);
+            edge_vector[e] = edge(i, j, 1.f - fabs(pts[i].normal.dot(pts[j].normal)));
+        }
+    });
 
     reset_progress();
 }
 
 
+// Maps floats to unsigned integers in the same order (flipping the sign bit of
+// positive numbers puts them above all negative ones, flipping all bits of
+// negative numbers reverses their order)
+static uint32_t weight_key(float weight)
+{
+    uint32_t bits;
+    memcpy(&bits, &weight, sizeof(bits));
+    return (bits & UINT32_C(0x80000000)) ? ~bits : bits | UINT32_C(0x80000000);
+}
+
+
 void rng::sort(void)
 {
-    std::sort(edge_vector.begin(), edge_vector.end());
+    parallel_radix_sort(edge_vector, [](const edge &e) { return weight_key(e.weight); }, 32);
+}
+
+
+rng::adjacency_list rng::adjacency(const std::vector<edge> &edges, size_t vertex_count)
+{
+    adjacency_list adj;
+    adj.offsets.resize(vertex_count + 1);
+
+    // Count the degrees first, so every list knows where it starts
+    std::vector<std::atomic<uint32_t>> degrees(vertex_count);
+    parallel_for(vertex_count, EDGE_CHUNK_SIZE, [&](size_t begin, size_t end) {
+        for (size_t v = begin; v < end; v++) {
+            degrees[v].store(0, std::memory_order_relaxed);
+        }
+    });
+
+    parallel_for(edges.size(), EDGE_CHUNK_SIZE, [&](size_t begin, size_t end) {
+        for (size_t e = begin; e < end; e++) {
+            degrees[edges[e].i].fetch_add(1, std::memory_order_relaxed);
+            degrees[edges[e].j].fetch_add(1, std::memory_order_relaxed);
+        }
+    });
+
+    adj.offsets[0] = 0;
+    for (size_t v = 0; v < vertex_count; v++) {
+        adj.offsets[v + 1] = adj.offsets[v] + degrees[v].load(std::memory_order_relaxed);
+        // Reused as the number of entries already filled in
+        degrees[v].store(0, std::memory_order_relaxed);
+    }
+
+    adj.neighbors.resize(adj.offsets[vertex_count]);
+    adj.weights.resize(adj.offsets[vertex_count]);
+
+    parallel_for(edges.size(), EDGE_CHUNK_SIZE, [&](size_t begin, size_t end) {
+        for (size_t e = begin; e < end; e++) {
+            const edge &ed = edges[e];
+
+            size_t slot_i = adj.offsets[ed.i] + degrees[ed.i].fetch_add(1, std::memory_order_relaxed);
+            size_t slot_j = adj.offsets[ed.j] + degrees[ed.j].fetch_add(1, std::memory_order_relaxed);
+
+            adj.neighbors[slot_i] = ed.j;
+            adj.weights  [slot_i] = ed.weight;
+            adj.neighbors[slot_j] = ed.i;
+            adj.weights  [slot_j] = ed.weight;
+        }
+    });
+
+    // The lists have been filled in whatever order the threads came by, so
+    // sort them to make the result deterministic
+    parallel_for(vertex_count, EDGE_CHUNK_SIZE, [&](size_t begin, size_t end) {
+        std::vector<std::pair<uint32_t, float>> list;
+
+        for (size_t v = begin; v < end; v++) {
+            size_t first = adj.offsets[v], last = adj.offsets[v + 1];
+
+            list.clear();
+            for (size_t s = first; s < last; s++) {
+                list.emplace_back(adj.neighbors[s], adj.weights[s]);
+            }
+            std::sort(list.begin(), list.end());
+
+            for (size_t s = first; s < last; s++) {
+                adj.neighbors[s] = list[s - first].first;
+                adj.weights  [s] = list[s - first].second;
+            }
+        }
+    });
+
+    return adj;
+}
+
+
+std::vector<rng::edge> rng::spanning_forest(std::vector<uint32_t> *components) const
+{
+    assert(edge_vector.size() < UINT32_MAX);
+
+    // Every component (identified by one of its vertices, its root) picks its
+    // lightest edge to any other component, and all of those edges are added
+    // to the forest at once, merging the components. As ties are broken by the
+    // edge index, this never closes a cycle, except that two components may
+    // pick the same edge to each other. There can be no more than half as
+    // many components after every round, so there are only logarithmically
+    // many rounds.
+    const uint64_t NO_EDGE = UINT64_MAX;
+
+    std::vector<uint32_t> comp(vertices), hook(vertices), next_hook(vertices);
+    std::vector<std::atomic<uint64_t>> lightest(vertices);
+    std::vector<char> in_forest(edge_vector.size(), 0);
+
+    parallel_for(vertices, EDGE_CHUNK_SIZE, [&](size_t begin, size_t end) {
+        for (size_t v = begin; v < end; v++) {
+            comp[v] = v;
+        }
+    });
+
+    for (;;) {
+        parallel_for(vertices, EDGE_CHUNK_SIZE, [&](size_t begin, size_t end) {
+            for (size_t v = begin; v < end; v++) {
+                lightest[v].store(NO_EDGE, std::memory_order_relaxed);
+            }
+        });
+
+        parallel_for(edge_vector.size(), EDGE_CHUNK_SIZE, [&](size_t begin, size_t end) {
+            for (size_t e = begin; e < end; e++) {
+                uint32_t ci = comp[edge_vector[e].i], cj = comp[edge_vector[e].j];
+                if (ci == cj) {
+                    continue;
+                }
+
+                uint64_t key = (static_cast<uint64_t>(weight_key(edge_vector[e].weight)) << 32) | e;
+                for (uint32_t c: {ci, cj}) {
+                    uint64_t cur = lightest[c].load(std::memory_order_relaxed);
+                    while ((key < cur) && !lightest[c].compare_exchange_weak(cur, key, std::memory_order_relaxed));
+                }
+            }
+        });
+
+        // Every root is hooked to the root at the other end of its lightest
+        // edge; of two components which picked the same edge, the one with
+        // the smaller root stays a root
+        std::atomic<size_t> hooked(0);
+        parallel_for(vertices, EDGE_CHUNK_SIZE, [&](size_t begin, size_t end) {
+            size_t chunk_hooked = 0;
+
+            for (size_t v = begin; v < end; v++) {
+                hook[v] = comp[v];
+
+                uint64_t key = lightest[v].load(std::memory_order_relaxed);
+                if ((comp[v] != v) || (key == NO_EDGE)) {
+                    continue;
+                }
+
+                const edge &ed = edge_vector[key & UINT32_MAX];
+                uint32_t other = comp[ed.i] == v ? comp[ed.j] : comp[ed.i];
+
+                if ((lightest[other].load(std::memory_order_relaxed) == key) && (v < other)) {
+                    continue;
+                }
+
+                hook[v] = other;
+                in_forest[key & UINT32_MAX] = 1;
+                chunk_hooked++;
+            }
+
+            hooked += chunk_hooked;
+        });
+
+        if (!hooked) {
+            break;
+        }
+
+        // Follow the hooks until every vertex points to the root of its new
+        // component (pointer jumping, which doubles the distance covered
+        // every step)
+        for (;;) {
+            std::atomic<bool> changed(false);
+
+            parallel_for(vertices, EDGE_CHUNK_SIZE, [&](size_t begin, size_t end) {
+                bool chunk_changed = false;
+
+                for (size_t v = begin; v < end; v++) {
+                    next_hook[v] = hook[hook[v]];
+                    if (next_hook[v] != hook[v]) {
+                        chunk_changed = true;
+                    }
+                }
+
+                if (chunk_changed) {
+                    changed = true;
+                }
+            });
+
+            hook.swap(next_hook);
+            if (!changed) {
+                break;
+            }
+        }
+
+        comp.swap(hook);
+    }
+
+    if (components) {
+        *components = std::move(comp);
+    }
+
+    std::vector<edge> forest;
+    for (size_t e = 0; e < edge_vector.size(); e++) {
+        if (in_forest[e]) {
+            forest.push_back(edge_vector[e]);
+        }
+    }
+    return forest;
 }
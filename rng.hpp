@@ -2,12 +2,14 @@
 #define RNG_HPP
 
 #include <cassert>
+#include <cstdint>
 #include <functional>
-#include <mutex>
 #include <vector>
 
 #include "cloud.hpp"
+#include "knn_approximation.hpp"
 #include "point.hpp"
+#include "spatial_index.hpp"
 
 
 // 乾杯 for ambiguous abbreviations
@@ -21,6 +23,7 @@ class rng {
             int i, j;
             float weight;
 
+            edge(void) {}
             edge(int _i, int _j, float w): i(_i), j(_j), weight(w) { assert((i < j) || (!i && !j)); }
 
             bool operator<(const edge &e) const { return weight < e.weight; }
@@ -31,13 +34,46 @@ class rng {
             bool operator()(const edge &e1, const edge &e2) const { return e2 < e1; }
         };
 
+        // The graph as adjacency lists in compressed sparse row form: the
+        // neighbors of point v are neighbors[offsets[v]] to
+        // neighbors[offsets[v + 1] - 1] (ascending), the weights of the
+        // respective edges are at the same places in weights. Every edge
+        // shows up in the lists of both of its points.
+        struct adjacency_list {
+            std::vector<size_t> offsets;
+            std::vector<uint32_t> neighbors;
+            std::vector<float> weights;
+
+            size_t vertex_count(void) const { return offsets.size() - 1; }
+            size_t degree(size_t v) const { return offsets[v + 1] - offsets[v]; }
+        };
+
 
-        rng(cloud &c, int k);
+        // Takes the neighbors from the cloud's neighbor graph
+        rng(const cloud &c, int k, spatial_index_type index_type = spatial_index_type::AUTO,
+            const knn_approximation &approx = knn_approximation());
 
 
-        // Sort edges ascending by weight
+        // Sort edges ascending by weight (edges of the same weight stay
+        // sorted by (i, j), which is how the constructor leaves them)
         void sort(void);
 
+        // Builds the adjacency lists of the current edges
+        adjacency_list adjacency(void) const
+        { return adjacency(edge_vector, vertices); }
+
+        // Same for any edge list over the given number of points (e.g. a
+        // spanning forest)
+        static adjacency_list adjacency(const std::vector<edge> &edges, size_t vertex_count);
+
+        // Minimum spanning forest of the graph (a minimum spanning tree for
+        // every connected component), computed on all cores with Borůvka's
+        // algorithm. The edges are returned in the order they have in
+        // edges(). If components is given, it receives a label for every
+        // point, which is the same for all points of a component (and is one
+        // of them).
+        std::vector<edge> spanning_forest(std::vector<uint32_t> *components = nullptr) const;
+
 
         std::vector<edge> &edges(void) { return edge_vector; }
         const std::vector<edge> &edges(void) const { return edge_vector; }
@@ -51,8 +87,13 @@ class rng {
 
 
     private:
+        enum {
+            EDGE_CHUNK_SIZE = 4096
+        };
+
         std::vector<edge> edge_vector;
-        std::mutex edge_mutex;
+        // Number of points of the cloud this graph has been built over
+        size_t vertices;
 };
 
 #endif
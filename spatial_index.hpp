@@ -0,0 +1,391 @@
+#ifndef SPATIAL_INDEX_HPP
+#define SPATIAL_INDEX_HPP
+
+#include <algorithm>
+#include <cassert>
+#include <climits>
+#include <cmath>
+#include <cstddef>
+#include <cstdint>
+#include <functional>
+#include <utility>
+#include <vector>
+#include <dake/math/matrix.hpp>
+
+#include "batch_queries.hpp"
+#include "knn_approximation.hpp"
+#include "parallel.hpp"
+#include "point.hpp"
+
+
+// Backends implementing spatial_index; kd_tree is the one which copes with
+// everything, the others are better for specific kinds of clouds (see
+// choose_spatial_index())
+enum class spatial_index_type {
+    AUTO,
+    KD_TREE,
+    UNIFORM_GRID,
+    OCTREE
+};
+
+
+// Common interface of all spatial indices over a cloud's point array, so the
+// algorithms can be run on any of them. All queries return indices into the
+// point array the index has been built over.
+template<unsigned K>
+class spatial_index: public batch_queries<spatial_index<K>, K> {
+    public:
+        typedef dake::math::vec<K, float> vector;
+
+        enum : uint32_t {
+            // Index given for neighbors which could not be found (because the
+            // cloud has fewer points than requested)
+            NO_NEIGHBOR = UINT32_MAX
+        };
+
+        virtual ~spatial_index(void) {}
+
+        // Number of points in the index
+        virtual size_t size(void) const = 0;
+
+        // Finds the given number of nearest neighbors of position and
+        // writes their indices (into the cloud's point array) and squared
+        // distances to the given buffers, ascending by distance. Returns the
+        // number of neighbors found, which is less than requested only if the
+        // cloud does not have enough points; the remaining entries are set to
+        // NO_NEIGHBOR and HUGE_VALF, respectively. See knn_approximation for
+        // approx.
+        virtual unsigned knn(const vector &position, unsigned neighbors, uint32_t *indices, float *sq_dists,
+                             const knn_approximation &approx = knn_approximation()) const = 0;
+
+        // Appends the indices and squared distances of all points within
+        // radius of position (in no particular order) to the given vectors
+        // and returns their number. sq_dists may be null.
+        virtual size_t radius_search(const vector &position, float radius, std::vector<uint32_t> &indices,
+                                     std::vector<float> *sq_dists = nullptr) const = 0;
+
+        // Counts all points within radius of position without collecting them
+        virtual size_t radius_count(const vector &position, float radius) const = 0;
+
+        // Appends the indices of all points p with min <= p <= max
+        // (component-wise) to indices and returns their number
+        virtual size_t box_search(const vector &min, const vector &max, std::vector<uint32_t> &indices) const = 0;
+
+        virtual size_t box_count(const vector &min, const vector &max) const = 0;
+
+        // Finds the given number of nearest neighbors of every point in
+        // points, which must be the point array the index has been built over
+        // (so every point is its own nearest neighbor), and writes those of
+        // point i to indices[i * neighbors] and sq_dists[i * neighbors]
+        // (following entries) as knn() does. This just runs one knn() per
+        // point; backends may share work between queries of nearby points.
+        virtual void all_knn(const std::vector<point> &points, unsigned neighbors, uint32_t *indices, float *sq_dists,
+                             const std::function<void(size_t)> &progress = std::function<void(size_t)>(),
+                             const knn_approximation &approx = knn_approximation()) const
+        {
+            this->knn_batch(points.size(),
+                [&](size_t i) {
+                    vector pos;
+                    for (unsigned d = 0; d < K; d++) {
+                        pos[d] = points[i].position[d];
+                    }
+                    return pos;
+                }, neighbors, indices, sq_dists, progress, approx);
+        }
+
+
+        // dist is the squared distance here; it is only ever compared, so
+        // there is no need to take the square root for every candidate
+        struct nearest_neighbor {
+            uint32_t index;
+            float dist;
+
+            nearest_neighbor(void) {}
+            nearest_neighbor(uint32_t i, float d): index(i), dist(d) {}
+
+            bool operator<(const nearest_neighbor &nn) const
+            { return dist < nn.dist; }
+        };
+
+
+        // Candidate queue for a k-nearest neighbor search: A max-heap of at
+        // most k entries (so the farthest neighbor is always on top), which
+        // lives on the stack for all k up to INLINE_CAPACITY and falls back
+        // to the heap only for larger k.
+        class neighbor_heap {
+            public:
+                enum {
+                    INLINE_CAPACITY = 64
+                };
+
+                neighbor_heap(unsigned neighbors): k(neighbors)
+                {
+                    if (k > INLINE_CAPACITY) {
+                        overflow.resize(k);
+                        entries = overflow.data();
+                    } else {
+                        entries = inline_entries;
+                    }
+                }
+
+                // entries points into the object itself, so it must not just
+                // be copied over
+                neighbor_heap(const neighbor_heap &h):
+                    overflow(h.overflow), count(h.count), k(h.k)
+                { adopt(h); }
+
+                neighbor_heap(neighbor_heap &&h) noexcept:
+                    overflow(std::move(h.overflow)), count(h.count), k(h.k)
+                { adopt(h); }
+
+                neighbor_heap &operator=(const neighbor_heap &h)
+                {
+                    if (this != &h) {
+                        overflow = h.overflow;
+                        count = h.count;
+                        k = h.k;
+                        adopt(h);
+                    }
+                    return *this;
+                }
+
+                neighbor_heap &operator=(neighbor_heap &&h) noexcept
+                {
+                    if (this != &h) {
+                        overflow = std::move(h.overflow);
+                        count = h.count;
+                        k = h.k;
+                        adopt(h);
+                    }
+                    return *this;
+                }
+
+                bool full(void) const
+                { return count >= k; }
+
+                // Distance a candidate has to beat to make it into the heap
+                // (only meaningful if full() is true)
+                float bound(void) const
+                { return entries[0].dist; }
+
+                void offer(uint32_t index, float dist)
+                {
+                    if (count < k) {
+                        // Holes left by removed points are infinitely far
+                        // away and must not fill up the heap
+                        if (dist < HUGE_VALF) {
+                            entries[count++] = nearest_neighbor(index, dist);
+                            std::push_heap(entries, entries + count);
+                        }
+                    } else if (dist < entries[0].dist) {
+                        replace_top(nearest_neighbor(index, dist));
+                    }
+                }
+
+                // Sorts the entries ascending by distance; the object is no
+                // longer a heap afterwards
+                const nearest_neighbor *sorted(void)
+                {
+                    std::sort_heap(entries, entries + count);
+                    return entries;
+                }
+
+                unsigned size(void) const
+                { return count; }
+
+
+            private:
+                nearest_neighbor inline_entries[INLINE_CAPACITY];
+                std::vector<nearest_neighbor> overflow;
+                nearest_neighbor *entries;
+                unsigned count = 0, k;
+
+                // Points entries at this object's storage, with h's entries
+                // in it (overflow has already been taken over)
+                void adopt(const neighbor_heap &h)
+                {
+                    if (k > INLINE_CAPACITY) {
+                        entries = overflow.data();
+                    } else {
+                        entries = inline_entries;
+                        std::copy(h.inline_entries, h.inline_entries + count, inline_entries);
+                    }
+                }
+
+                // Sift the new entry down from the top instead of doing a
+                // pop_heap()/push_heap() pair
+                void replace_top(const nearest_neighbor &nn)
+                {
+                    unsigned i = 0;
+                    for (;;) {
+                        unsigned child = 2 * i + 1;
+                        if (child >= count) {
+                            break;
+                        }
+                        if ((child + 1 < count) && (entries[child].dist < entries[child + 1].dist)) {
+                            child++;
+                        }
+                        if (entries[child].dist <= nn.dist) {
+                            break;
+                        }
+                        entries[i] = entries[child];
+                        i = child;
+                    }
+                    entries[i] = nn;
+                }
+        };
+
+        // Same interface for k = 1 (which is what ICP does), where there is
+        // nothing to be sorted at all
+        class single_neighbor {
+            public:
+                single_neighbor(unsigned neighbors = 1)
+                { assert(neighbors == 1); (void)neighbors; }
+
+                bool full(void) const
+                { return best.index != NO_NEIGHBOR; }
+
+                float bound(void) const
+                { return best.dist; }
+
+                void offer(uint32_t index, float dist)
+                {
+                    if (dist < best.dist) {
+                        best = nearest_neighbor(index, dist);
+                    }
+                }
+
+                const nearest_neighbor *sorted(void) const
+                { return &best; }
+
+                unsigned size(void) const
+                { return full() ? 1 : 0; }
+
+
+            private:
+                nearest_neighbor best = nearest_neighbor(NO_NEIGHBOR, HUGE_VALF);
+        };
+
+
+    protected:
+        template<typename Queue>
+        static unsigned store_results(Queue &queue, unsigned neighbors, uint32_t *indices, float *sq_dists)
+        {
+            const nearest_neighbor *sorted = queue.sorted();
+            unsigned found = queue.size();
+
+            for (unsigned i = 0; i < found; i++) {
+                indices[i]  = sorted[i].index;
+                sq_dists[i] = sorted[i].dist;
+            }
+            for (unsigned i = found; i < neighbors; i++) {
+                indices[i]  = NO_NEIGHBOR;
+                sq_dists[i] = HUGE_VALF;
+            }
+
+            return found;
+        }
+
+        template<typename Queue>
+        struct knn_search {
+            Queue queue;
+            const vector &position;
+            // Subtrees (or cells) are pruned if their squared distance times
+            // this is not less than the current bound (so this is 1 for exact
+            // searches)
+            float prune_scale;
+            // Leaves (or cells) scanned so far count against this
+            unsigned leaf_visits_left;
+
+            knn_search(const vector &pos, unsigned neighbors, const knn_approximation &approx):
+                queue(neighbors),
+                position(pos),
+                prune_scale((1.f + approx.epsilon) * (1.f + approx.epsilon)),
+                leaf_visits_left(approx.max_leaf_visits ? approx.max_leaf_visits : UINT_MAX)
+            {}
+
+            bool done(void) const
+            { return !leaf_visits_left && queue.full(); }
+        };
+};
+
+
+// Bounding box of the given points (which is empty, i.e. min > max, if there
+// are none)
+template<unsigned K>
+void point_bounds(const std::vector<point> &points, dake::math::vec<K, float> &bounds_min,
+                  dake::math::vec<K, float> &bounds_max)
+{
+    enum {
+        CHUNK_SIZE = 65536
+    };
+
+    size_t chunks = (points.size() + CHUNK_SIZE - 1) / CHUNK_SIZE;
+    std::vector<dake::math::vec<K, float>> chunk_min(chunks), chunk_max(chunks);
+
+    parallel_for(points.size(), CHUNK_SIZE, [&](size_t begin, size_t end) {
+        dake::math::vec<K, float> &cmin = chunk_min[begin / CHUNK_SIZE];
+        dake::math::vec<K, float> &cmax = chunk_max[begin / CHUNK_SIZE];
+
+        for (unsigned d = 0; d < K; d++) {
+            cmin[d] =  HUGE_VALF;
+            cmax[d] = -HUGE_VALF;
+        }
+
+        for (size_t i = begin; i < end; i++) {
+            for (unsigned d = 0; d < K; d++) {
+                cmin[d] = std::min(cmin[d], points[i].position[d]);
+                cmax[d] = std::max(cmax[d], points[i].position[d]);
+            }
+        }
+    });
+
+    for (unsigned d = 0; d < K; d++) {
+        bounds_min[d] =  HUGE_VALF;
+        bounds_max[d] = -HUGE_VALF;
+    }
+
+    for (size_t c = 0; c < chunks; c++) {
+        for (unsigned d = 0; d < K; d++) {
+            bounds_min[d] = std::min(bounds_min[d], chunk_min[c][d]);
+            bounds_max[d] = std::max(bounds_max[d], chunk_max[c][d]);
+        }
+    }
+}
+
+
+// Picks a backend for queries for the given number of neighbors in a cloud of
+// point_count points within the given bounding box. The kd tree is the best
+// choice for most queries; only plain nearest neighbor searches (as ICP does)
+// in big clouds are faster with the uniform grid (300k points in a cube or on
+// a sphere: 20 % faster queries, 40 % faster construction, whereas for k = 10
+// the grid takes twice as long). The octree is only useful where its
+// hierarchy is needed (e.g. for levels of detail), so it is never picked
+// automatically.
+template<unsigned K>
+spatial_index_type choose_spatial_index(const dake::math::vec<K, float> &bounds_min,
+                                        const dake::math::vec<K, float> &bounds_max,
+                                        size_t point_count, unsigned neighbors)
+{
+    enum {
+        GRID_MIN_POINTS = 100000,
+        GRID_MAX_NEIGHBORS = 2
+    };
+
+    if ((point_count < GRID_MIN_POINTS) || (neighbors > GRID_MAX_NEIGHBORS)) {
+        return spatial_index_type::KD_TREE;
+    }
+
+    // A grid over a single point (or nothing at all) would not be much of a
+    // grid
+    bool degenerate = true;
+    for (unsigned d = 0; d < K; d++) {
+        if (bounds_max[d] > bounds_min[d]) {
+            degenerate = false;
+        }
+    }
+
+    return degenerate ? spatial_index_type::KD_TREE : spatial_index_type::UNIFORM_GRID;
+}
+
+#endif
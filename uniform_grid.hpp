@@ -0,0 +1,584 @@
+#ifndef UNIFORM_GRID_HPP
+#define UNIFORM_GRID_HPP
+
+#include <algorithm>
+#include <cassert>
+#include <cmath>
+#include <cstdint>
+#include <utility>
+#include <vector>
+#include <dake/math/matrix.hpp>
+
+#include "knn_approximation.hpp"
+#include "morton_order.hpp"
+#include "parallel.hpp"
+#include "point.hpp"
+#include "spatial_index.hpp"
+
+
+// A grid of equally sized cubic cells over the cloud's bounding box. Only the
+// cells which actually contain points are stored (in a hash table), so scans
+// (which are mostly surfaces) do not waste memory on all the empty space in
+// their bounding box. The cell size is chosen such that the average occupied
+// cell holds a few points; KNN queries then just scan the query's cell and the
+// rings of cells around it until no nearer point can be found. For clouds of
+// roughly uniform density this beats a kd tree, as there is no tree to descend.
+template<unsigned K>
+class uniform_grid final: public spatial_index<K> {
+    public:
+        typedef typename spatial_index<K>::vector vector;
+
+        enum : uint32_t {
+            NO_NEIGHBOR = spatial_index<K>::NO_NEIGHBOR
+        };
+
+
+        uniform_grid(const std::vector<point> &points):
+            order(points)
+        {
+            level = choose_level();
+            cell_edge = order.level_cell_size(level);
+            grid_cells = order.level_cells(level);
+
+            unsigned shift = K * level;
+            for (uint32_t i = 0; i < order.codes.size(); i++) {
+                uint64_t code = order.codes[i] >> shift;
+                if (cells.empty() || (cells.back().code != code)) {
+                    cells.emplace_back();
+                    cells.back().code = code;
+                    cells.back().begin = i;
+                    morton_order<K>::decode(code, cells.back().coords);
+                }
+                cells.back().end = i + 1;
+            }
+
+            size_t table_size = 1;
+            while (table_size < 2 * cells.size()) {
+                table_size *= 2;
+            }
+            table.resize(table_size, NO_CELL);
+            table_mask = table_size - 1;
+
+            for (uint32_t i = 0; i < cells.size(); i++) {
+                uint64_t slot = hash(cells[i].code) & table_mask;
+                while (table[slot] != NO_CELL) {
+                    slot = (slot + 1) & table_mask;
+                }
+                table[slot] = i;
+            }
+        }
+
+        uniform_grid(const uniform_grid &) = delete;
+        uniform_grid &operator=(const uniform_grid &) = delete;
+
+
+        size_t size(void) const override
+        { return order.indices.size(); }
+
+        unsigned knn(const vector &position, unsigned neighbors, uint32_t *indices, float *sq_dists,
+                     const knn_approximation &approx = knn_approximation()) const override
+        {
+            assert(neighbors > 0);
+
+            if (neighbors == 1) {
+                return knn_collect<typename spatial_index<K>::single_neighbor>(position, neighbors, indices, sq_dists, approx);
+            } else {
+                return knn_collect<typename spatial_index<K>::neighbor_heap>(position, neighbors, indices, sq_dists, approx);
+            }
+        }
+
+        size_t radius_search(const vector &position, float radius, std::vector<uint32_t> &indices,
+                             std::vector<float> *sq_dists = nullptr) const override
+        {
+            size_t found = 0;
+            float sq_radius = radius * radius;
+
+            radius_cells(position, radius, [&](const cell &c, float, float) {
+                for (uint32_t i = c.begin; i < c.end; i++) {
+                    vector diff = position - order.positions[i];
+                    float sq_dist = diff.dot(diff);
+                    if (sq_dist <= sq_radius) {
+                        indices.push_back(order.indices[i]);
+                        if (sq_dists) {
+                            sq_dists->push_back(sq_dist);
+                        }
+                        found++;
+                    }
+                }
+            });
+
+            return found;
+        }
+
+        // Cells completely inside of the sphere are counted without being
+        // scanned
+        size_t radius_count(const vector &position, float radius) const override
+        {
+            size_t found = 0;
+            float sq_radius = radius * radius;
+
+            radius_cells(position, radius, [&](const cell &c, float, float sq_far) {
+                if (sq_far <= sq_radius) {
+                    found += c.end - c.begin;
+                    return;
+                }
+
+                for (uint32_t i = c.begin; i < c.end; i++) {
+                    vector diff = position - order.positions[i];
+                    if (diff.dot(diff) <= sq_radius) {
+                        found++;
+                    }
+                }
+            });
+
+            return found;
+        }
+
+        size_t box_search(const vector &min, const vector &max, std::vector<uint32_t> &indices) const override
+        {
+            size_t found = 0;
+
+            box_cells(min, max, [&](const cell &c, bool) {
+                for (uint32_t i = c.begin; i < c.end; i++) {
+                    if (in_box(order.positions[i], min, max)) {
+                        indices.push_back(order.indices[i]);
+                        found++;
+                    }
+                }
+            });
+
+            return found;
+        }
+
+        size_t box_count(const vector &min, const vector &max) const override
+        {
+            size_t found = 0;
+
+            box_cells(min, max, [&](const cell &c, bool contained) {
+                if (contained) {
+                    found += c.end - c.begin;
+                    return;
+                }
+
+                for (uint32_t i = c.begin; i < c.end; i++) {
+                    if (in_box(order.positions[i], min, max)) {
+                        found++;
+                    }
+                }
+            });
+
+            return found;
+        }
+
+
+    private:
+        enum : uint32_t {
+            NO_CELL = UINT32_MAX,
+
+            // Aim for this many points in the average occupied cell
+            POINTS_PER_CELL = 4
+        };
+
+        struct cell {
+            uint64_t code;
+            uint32_t coords[K];
+            // Range in the Z-order
+            uint32_t begin, end;
+        };
+
+        template<typename Queue>
+        using knn_search = typename spatial_index<K>::template knn_search<Queue>;
+
+        morton_order<K> order;
+        unsigned level;
+        float cell_edge;
+        int64_t grid_cells;
+
+        // Occupied cells in Z-order, and a hash table (open addressing) of
+        // indices into it
+        std::vector<cell> cells;
+        std::vector<uint32_t> table;
+        uint64_t table_mask;
+
+
+        static uint64_t hash(uint64_t code)
+        {
+            code ^= code >> 33;
+            code *= UINT64_C(0xff51afd7ed558ccd);
+            code ^= code >> 33;
+            return code;
+        }
+
+        // The finest level whose average occupied cell has at least
+        // POINTS_PER_CELL points. The number of occupied cells on every level
+        // follows from the Z-order alone: Two neighbors in it are in different
+        // cells on all levels below the one where their codes' highest
+        // differing bit is shifted out.
+        unsigned choose_level(void) const
+        {
+            enum {
+                LEVELS = morton_order<K>::BITS + 1
+            };
+
+            size_t n = order.codes.size();
+            size_t chunks = (n + morton_order<K>::CHUNK_SIZE - 1) / morton_order<K>::CHUNK_SIZE;
+            std::vector<std::vector<size_t>> chunk_changes(chunks, std::vector<size_t>(LEVELS));
+
+            parallel_for(n, morton_order<K>::CHUNK_SIZE, [&](size_t begin, size_t end) {
+                std::vector<size_t> &changes = chunk_changes[begin / morton_order<K>::CHUNK_SIZE];
+                for (size_t i = std::max(begin, static_cast<size_t>(1)); i < end; i++) {
+                    uint64_t diff = order.codes[i] ^ order.codes[i - 1];
+                    if (diff) {
+                        changes[(63 - __builtin_clzll(diff)) / K]++;
+                    }
+                }
+            });
+
+            size_t distinct = 1;
+            std::vector<size_t> distinct_at(LEVELS);
+            for (int l = LEVELS - 1; l >= 0; l--) {
+                for (size_t c = 0; c < chunks; c++) {
+                    distinct += chunk_changes[c][l];
+                }
+                distinct_at[l] = distinct;
+            }
+
+            for (unsigned l = 0; l < LEVELS; l++) {
+                if (n >= POINTS_PER_CELL * distinct_at[l]) {
+                    return l;
+                }
+            }
+            return LEVELS - 1;
+        }
+
+        const cell *find(const uint32_t *coords) const
+        {
+            uint64_t code = morton_order<K>::code(coords);
+
+            for (uint64_t slot = hash(code) & table_mask; table[slot] != NO_CELL; slot = (slot + 1) & table_mask) {
+                if (cells[table[slot]].code == code) {
+                    return &cells[table[slot]];
+                }
+            }
+
+            return nullptr;
+        }
+
+        void cell_bounds(const uint32_t *coords, vector &cell_min, vector &cell_max) const
+        {
+            for (unsigned d = 0; d < K; d++) {
+                cell_min[d] = order.bounds_min[d] + coords[d] * cell_edge;
+                cell_max[d] = cell_min[d] + cell_edge;
+            }
+        }
+
+        float sq_dist_to_cell(const vector &position, const uint32_t *coords) const
+        {
+            vector cell_min, cell_max;
+            cell_bounds(coords, cell_min, cell_max);
+
+            float sq_dist = 0.f;
+            for (unsigned d = 0; d < K; d++) {
+                float out = std::max(std::max(cell_min[d] - position[d], position[d] - cell_max[d]), 0.f);
+                sq_dist += out * out;
+            }
+            return sq_dist;
+        }
+
+        static bool in_box(const vector &p, const vector &min, const vector &max)
+        {
+            for (unsigned d = 0; d < K; d++) {
+                if ((p[d] < min[d]) || (p[d] > max[d])) {
+                    return false;
+                }
+            }
+            return true;
+        }
+
+        // Calls fn(cell) for every occupied cell within the given (inclusive)
+        // range of cell coordinates. If the range has more cells than there
+        // are occupied ones, it is cheaper to just check all of those.
+        template<typename Fn>
+        void cells_in_range(const int64_t *lo_in, const int64_t *hi_in, Fn fn) const
+        {
+            int64_t lo[K], hi[K];
+            double range_cells = 1.;
+
+            for (unsigned d = 0; d < K; d++) {
+                lo[d] = std::max(lo_in[d], INT64_C(0));
+                hi[d] = std::min(hi_in[d], grid_cells - 1);
+                if (lo[d] > hi[d]) {
+                    return;
+                }
+                range_cells *= hi[d] - lo[d] + 1;
+            }
+
+            if (range_cells > cells.size()) {
+                for (const cell &c: cells) {
+                    bool inside = true;
+                    for (unsigned d = 0; d < K; d++) {
+                        if ((c.coords[d] < lo[d]) || (c.coords[d] > hi[d])) {
+                            inside = false;
+                            break;
+                        }
+                    }
+                    if (inside) {
+                        fn(c);
+                    }
+                }
+                return;
+            }
+
+            uint32_t coords[K];
+            for (unsigned d = 0; d < K; d++) {
+                coords[d] = lo[d];
+            }
+
+            for (;;) {
+                const cell *c = find(coords);
+                if (c) {
+                    fn(*c);
+                }
+
+                unsigned d = 0;
+                while ((d < K) && (++coords[d] > hi[d])) {
+                    coords[d] = lo[d];
+                    d++;
+                }
+                if (d == K) {
+                    break;
+                }
+            }
+        }
+
+        // Calls fn(cell, sq_near, sq_far) for every occupied cell which
+        // intersects the sphere, with the squared distances of its nearest and
+        // farthest point from position
+        template<typename Fn>
+        void radius_cells(const vector &position, float radius, Fn fn) const
+        {
+            float sq_radius = radius * radius;
+            vector rv;
+            for (unsigned d = 0; d < K; d++) {
+                rv[d] = radius;
+            }
+
+            int64_t lo[K], hi[K];
+            order.unclamped_cell_coords(position - rv, level, lo);
+            order.unclamped_cell_coords(position + rv, level, hi);
+
+            cells_in_range(lo, hi, [&](const cell &c) {
+                vector cell_min, cell_max;
+                cell_bounds(c.coords, cell_min, cell_max);
+
+                float sq_near = 0.f, sq_far = 0.f;
+                for (unsigned d = 0; d < K; d++) {
+                    float to_min = position[d] - cell_min[d];
+                    float to_max = cell_max[d] - position[d];
+
+                    float near = std::max(std::max(-to_min, -to_max), 0.f);
+                    float far  = std::max(fabsf(to_min), fabsf(to_max));
+                    sq_near += near * near;
+                    sq_far  += far * far;
+                }
+
+                if (sq_near <= sq_radius) {
+                    fn(c, sq_near, sq_far);
+                }
+            });
+        }
+
+        // Calls fn(cell, contained) for every occupied cell which intersects
+        // the box, contained telling whether it is completely inside of it
+        template<typename Fn>
+        void box_cells(const vector &min, const vector &max, Fn fn) const
+        {
+            int64_t lo[K], hi[K];
+            order.unclamped_cell_coords(min, level, lo);
+            order.unclamped_cell_coords(max, level, hi);
+
+            cells_in_range(lo, hi, [&](const cell &c) {
+                vector cell_min, cell_max;
+                cell_bounds(c.coords, cell_min, cell_max);
+
+                bool contained = true;
+                for (unsigned d = 0; d < K; d++) {
+                    if ((cell_min[d] < min[d]) || (cell_max[d] > max[d])) {
+                        contained = false;
+                        break;
+                    }
+                }
+
+                fn(c, contained);
+            });
+        }
+
+        // Whether a cell may contain a point which is nearer than the
+        // current bound (this is checked before the cell is even looked up)
+        template<typename Queue>
+        bool worth_scanning(const knn_search<Queue> &search, const uint32_t *coords) const
+        {
+            return !search.queue.full() || (sq_dist_to_cell(search.position, coords) * search.prune_scale < search.queue.bound());
+        }
+
+        template<typename Queue>
+        void scan_cell(knn_search<Queue> &search, const cell &c) const
+        {
+            for (uint32_t i = c.begin; i < c.end; i++) {
+                vector diff = search.position - order.positions[i];
+                search.queue.offer(order.indices[i], diff.dot(diff));
+            }
+
+            if (search.leaf_visits_left) {
+                search.leaf_visits_left--;
+            }
+        }
+
+        // Scans all cells at Chebyshev distance r (in cells) from the one at
+        // center, nearest first (so the bound shrinks as fast as possible and
+        // the farther ones can be skipped); ring is just a buffer
+        template<typename Queue>
+        void scan_ring(knn_search<Queue> &search, const int64_t *center, int64_t r,
+                       std::vector<std::pair<float, const cell *>> &ring) const
+        {
+            ring.clear();
+
+            int64_t lo[K], hi[K];
+            for (unsigned d = 0; d < K; d++) {
+                lo[d] = std::max(center[d] - r, INT64_C(0));
+                hi[d] = std::min(center[d] + r, grid_cells - 1);
+                if (lo[d] > hi[d]) {
+                    return;
+                }
+            }
+
+            uint32_t coords[K];
+            for (unsigned d = 0; d < K - 1; d++) {
+                coords[d] = lo[d];
+            }
+
+            for (;;) {
+                bool on_shell = false;
+                for (unsigned d = 0; d < K - 1; d++) {
+                    if ((coords[d] == center[d] - r) || (coords[d] == center[d] + r)) {
+                        on_shell = true;
+                        break;
+                    }
+                }
+
+                // On the shell, all cells along the last dimension belong to
+                // the ring; otherwise, only the two at its ends do
+                int64_t step = on_shell || !r ? 1 : 2 * r;
+                for (int64_t z = center[K - 1] - r; z <= center[K - 1] + r; z += step) {
+                    if ((z < lo[K - 1]) || (z > hi[K - 1])) {
+                        continue;
+                    }
+
+                    coords[K - 1] = z;
+                    float sq_dist = sq_dist_to_cell(search.position, coords);
+                    if (search.queue.full() && (sq_dist * search.prune_scale >= search.queue.bound())) {
+                        continue;
+                    }
+
+                    const cell *c = find(coords);
+                    if (c) {
+                        ring.emplace_back(sq_dist, c);
+                    }
+                }
+
+                unsigned d = 0;
+                while ((d < K - 1) && (++coords[d] > hi[d])) {
+                    coords[d] = lo[d];
+                    d++;
+                }
+                if (d >= K - 1) {
+                    break;
+                }
+            }
+
+            std::sort(ring.begin(), ring.end(), [](const std::pair<float, const cell *> &c1, const std::pair<float, const cell *> &c2) {
+                return c1.first < c2.first;
+            });
+
+            for (const auto &c: ring) {
+                if (search.done() || (search.queue.full() && (c.first * search.prune_scale >= search.queue.bound()))) {
+                    break;
+                }
+                scan_cell(search, *c.second);
+            }
+        }
+
+        template<typename Queue>
+        unsigned knn_collect(const vector &position, unsigned neighbors, uint32_t *indices, float *sq_dists,
+                             const knn_approximation &approx) const
+        {
+            knn_search<Queue> search(position, neighbors, approx);
+
+            if (cells.empty()) {
+                return spatial_index<K>::store_results(search.queue, neighbors, indices, sq_dists);
+            }
+
+            int64_t center[K];
+            order.unclamped_cell_coords(position, level, center);
+
+            std::vector<std::pair<float, const cell *>> ring;
+
+            // Everything outside of the center cell is at least this far away
+            float gap = HUGE_VALF;
+            // The first ring which may contain any cell (for positions outside
+            // of the grid), and the one which contains the whole grid
+            int64_t first_ring = 0, last_ring = 0;
+
+            for (unsigned d = 0; d < K; d++) {
+                float cell_min = order.bounds_min[d] + center[d] * cell_edge;
+                gap = std::min(gap, std::min(position[d] - cell_min, cell_min + cell_edge - position[d]));
+
+                first_ring = std::max(first_ring, std::max(-center[d], center[d] - (grid_cells - 1)));
+                last_ring  = std::max(last_ring,  std::max(center[d], grid_cells - 1 - center[d]));
+            }
+            gap = std::max(gap, 0.f);
+
+            for (int64_t r = first_ring; r <= last_ring; r++) {
+                if ((r > 0) && search.queue.full()) {
+                    float near = (r - 1) * cell_edge + gap;
+                    if (near * near * search.prune_scale >= search.queue.bound()) {
+                        break;
+                    }
+                }
+
+                // Sparse neighborhoods would make the rings grow over lots of
+                // empty cells; once a ring is bigger than the number of
+                // occupied cells, just check all of those that are left
+                double ring_cells = 1.;
+                for (unsigned d = 0; d < K; d++) {
+                    ring_cells *= 2 * r + 1;
+                }
+
+                if (ring_cells > cells.size()) {
+                    for (const cell &c: cells) {
+                        int64_t dist = 0;
+                        for (unsigned d = 0; d < K; d++) {
+                            dist = std::max(dist, std::abs(static_cast<int64_t>(c.coords[d]) - center[d]));
+                        }
+                        if ((dist >= r) && worth_scanning(search, c.coords)) {
+                            scan_cell(search, c);
+                            if (search.done()) {
+                                break;
+                            }
+                        }
+                    }
+                    break;
+                }
+
+                scan_ring(search, center, r, ring);
+
+                if (search.done()) {
+                    break;
+                }
+            }
+
+            return spatial_index<K>::store_results(search.queue, neighbors, indices, sq_dists);
+        }
+};
+
+#endif
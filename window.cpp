@@ -19,6 +19,7 @@
 #include <QComboBox>
 #include <QProgressBar>
 #include <QScrollArea>
+#include <QStatusBar>
 
 #include "cloud.hpp"
 #include "render_output.hpp"
@@ -211,10 +212,39 @@ window::window(void):
     cull_ratio = new QDoubleSpinBox;
     cull_ratio->setRange(0., 100.);
     cull_ratio->setValue(10.);
+    sor = new QPushButton("Remove statistical outliers");
+    sor_std_label = new QLabel("σ multiplier (uses k):");
+    sor_std = new QDoubleSpinBox;
+    sor_std->setRange(0., 100.);
+    sor_std->setSingleStep(.1);
+    sor_std->setValue(1.);
+    ror = new QPushButton("Remove radius outliers");
+    ror_radius_label = new QLabel("Radius:");
+    ror_radius = new QDoubleSpinBox;
+    ror_radius->setDecimals(4);
+    ror_radius->setRange(0., HUGE_VAL);
+    ror_radius->setSingleStep(.01);
+    ror_radius->setValue(.1);
+    ror_min_label = new QLabel("Minimum neighbor count:");
+    ror_min = new QSpinBox;
+    ror_min->setRange(0, INT_MAX);
+    ror_min->setValue(5);
     k_label = new QLabel("k (neighbor count):");
     k = new QSpinBox;
     k->setRange(1, INT_MAX);
     k->setValue(5);
+    knn_eps_label = new QLabel("ε (approximate KNN):");
+    knn_eps = new QDoubleSpinBox;
+    knn_eps->setRange(0., 10.);
+    knn_eps->setSingleStep(.1);
+    knn_eps->setValue(0.);
+    index_backend_label = new QLabel("Spatial index:");
+    index_backend = new QComboBox;
+    // Same order as spatial_index_type
+    index_backend->addItem("Automatic");
+    index_backend->addItem("kd tree");
+    index_backend->addItem("Uniform grid");
+    index_backend->addItem("Octree");
     rng = new QCheckBox("Riemann graph");
     icp = new QPushButton("ICP");
     icp_n_label = new QLabel("N (reg. point count):");
@@ -273,9 +303,21 @@ window::window(void):
     l2->addWidget(cull);
     l2->addWidget(cull_ratio_label);
     l2->addWidget(cull_ratio);
+    l2->addWidget(sor);
+    l2->addWidget(sor_std_label);
+    l2->addWidget(sor_std);
+    l2->addWidget(ror);
+    l2->addWidget(ror_radius_label);
+    l2->addWidget(ror_radius);
+    l2->addWidget(ror_min_label);
+    l2->addWidget(ror_min);
     l2->addWidget(f[5]);
     l2->addWidget(k_label);
     l2->addWidget(k);
+    l2->addWidget(knn_eps_label);
+    l2->addWidget(knn_eps);
+    l2->addWidget(index_backend_label);
+    l2->addWidget(index_backend);
     l2->addWidget(rng);
     l2->addWidget(f[6]);
     l2->addWidget(icp);
@@ -321,6 +363,8 @@ window::window(void):
     connect(unload, SIGNAL(pressed()), this, SLOT(unload_cloud()));
     connect(rnd_trans, SIGNAL(pressed()), this, SLOT(randomize_transformations()));
     connect(cull, SIGNAL(pressed()), this, SLOT(do_cull()));
+    connect(sor, SIGNAL(pressed()), this, SLOT(do_statistical_outlier_removal()));
+    connect(ror, SIGNAL(pressed()), this, SLOT(do_radius_outlier_removal()));
     connect(renormal, SIGNAL(pressed()), this, SLOT(recalc_normals()));
     connect(icp, SIGNAL(pressed()), this, SLOT(do_icp()));
 
@@ -382,8 +426,20 @@ window::~window(void)
     delete icp_n_label;
     delete icp;
     delete rng;
+    delete index_backend;
+    delete index_backend_label;
+    delete knn_eps;
+    delete knn_eps_label;
     delete k;
     delete k_label;
+    delete ror_min;
+    delete ror_min_label;
+    delete ror_radius;
+    delete ror_radius_label;
+    delete ror;
+    delete sor_std;
+    delete sor_std_label;
+    delete sor;
     delete cull_ratio;
     delete cull_ratio_label;
     delete cull;
@@ -448,19 +504,8 @@ void window::load_cloud(void)
                                                       "Polygon files (*.ply);;All files (*.*)");
 
     for (const auto &path: paths) {
-        std::ifstream inp(path.toUtf8().constData());
-        if (!inp.is_open()) {
-            QMessageBox::critical(this, "Could not open file", QString("Could not open ") + path + QString(": ") + QString(strerror(errno)));
-            // > errno
-            // > strerror
-            // > C++
-            // i haet u too, stl
-            // qt, plz
-            continue;
-        }
-
         try {
-            cm.load_new(inp, QFileInfo(path).fileName().toUtf8().constData());
+            cm.load_new(path.toUtf8().constData(), QFileInfo(path).fileName().toUtf8().constData());
         } catch (const std::exception &e) {
             QMessageBox::critical(this, "Error", QString("Could not load from ") + path + QString(": ") + QString(e.what()));
         }
@@ -483,12 +528,15 @@ void window::store_cloud(void)
         return;
     }
 
+    QString binary_filter("Binary polygon files (*.ply)");
+    QString filter;
     QString path = QFileDialog::getSaveFileName(this,
                                                 "Store point cloud",
                                                 QString(),
-                                                "Polygon files (*.ply);;All files (*.*)");
+                                                "Polygon files (*.ply);;" + binary_filter + ";;All files (*.*)",
+                                                &filter);
 
-    std::ofstream out(path.toUtf8().constData());
+    std::ofstream out(path.toUtf8().constData(), std::ios_base::out | std::ios_base::binary);
     if (!out.is_open()) {
         QMessageBox::critical(this, "Could not write to file", QString("Could not write to file ") + path + QString(": ") + QString(strerror(errno)));
         return;
@@ -500,7 +548,7 @@ void window::store_cloud(void)
     const cloud *c = reinterpret_cast<const cloud *>(static_cast<uintptr_t>(clouds->currentData().value<qulonglong>()));
 
     try {
-        c->store(out);
+        c->store(out, filter == binary_filter ? ply_format::BINARY_LITTLE_ENDIAN : ply_format::ASCII);
     } catch (const std::exception &e) {
         QMessageBox::critical(this, "Error", QString("Could not store ") + QString(c->name().c_str()) + QString(": ") + QString(e.what()));
     }
@@ -539,10 +587,12 @@ void window::do_cull(void)
 {
     float ratio = static_cast<float>(cull_ratio->value()) / 100.f;
     int kv = k->value();
+    knn_approximation approx(knn_eps->value());
+    spatial_index_type backend = static_cast<spatial_index_type>(index_backend->currentIndex());
 
     for (cloud &c: cm.clouds()) {
         try {
-            c.cull_outliers(ratio, kv);
+            c.cull_outliers(ratio, kv, approx, backend);
         } catch (const std::exception &e) {
             QMessageBox::critical(this, "Error", QString("Could not cull outliers from ") + QString(c.name().c_str()) + QString(": ") + QString(e.what()));
         }
@@ -552,14 +602,57 @@ void window::do_cull(void)
 }
 
 
+void window::do_statistical_outlier_removal(void)
+{
+    float std_ratio = static_cast<float>(sor_std->value());
+    int kv = k->value();
+    knn_approximation approx(knn_eps->value());
+    spatial_index_type backend = static_cast<spatial_index_type>(index_backend->currentIndex());
+
+    size_t removed = 0;
+    for (cloud &c: cm.clouds()) {
+        try {
+            removed += c.remove_statistical_outliers(kv, std_ratio, approx, backend);
+        } catch (const std::exception &e) {
+            QMessageBox::critical(this, "Error", QString("Could not remove outliers from ") + QString(c.name().c_str()) + QString(": ") + QString(e.what()));
+        }
+    }
+
+    statusBar()->showMessage(QString("Removed %1 points").arg(removed));
+    gl->invalidate();
+}
+
+
+void window::do_radius_outlier_removal(void)
+{
+    float radius = static_cast<float>(ror_radius->value());
+    unsigned min_neighbors = ror_min->value();
+    spatial_index_type backend = static_cast<spatial_index_type>(index_backend->currentIndex());
+
+    size_t removed = 0;
+    for (cloud &c: cm.clouds()) {
+        try {
+            removed += c.remove_radius_outliers(radius, min_neighbors, backend);
+        } catch (const std::exception &e) {
+            QMessageBox::critical(this, "Error", QString("Could not remove outliers from ") + QString(c.name().c_str()) + QString(": ") + QString(e.what()));
+        }
+    }
+
+    statusBar()->showMessage(QString("Removed %1 points").arg(removed));
+    gl->invalidate();
+}
+
+
 void window::recalc_normals(void)
 {
     bool inv = renormal_inv->checkState() == Qt::Checked;
     int kv = k->value();
+    knn_approximation approx(knn_eps->value());
+    spatial_index_type backend = static_cast<spatial_index_type>(index_backend->currentIndex());
 
     for (cloud &c: cm.clouds()) {
         try {
-            c.recalc_normals(kv, inv);
+            c.recalc_normals(kv, inv, approx, backend);
         } catch (const std::exception &e) {
             QMessageBox::critical(this, "Error", QString("Could not recalculate the normals for ") + QString(c.name().c_str()) + QString(": ") + QString(e.what()));
         }
@@ -572,7 +665,8 @@ void window::recalc_normals(void)
 void window::do_icp(void)
 {
     try {
-        cm.icp(icp_m->value(), icp_n->value(), icp_p->value());
+        cm.icp(icp_m->value(), icp_n->value(), icp_p->value(), knn_approximation(knn_eps->value()),
+               static_cast<spatial_index_type>(index_backend->currentIndex()));
     } catch (const std::exception &e) {
         QMessageBox::critical(this, "Error", QString("Could not do ICP: ") + QString(e.what()));
     }
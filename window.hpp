@@ -34,6 +34,8 @@ class window:
         void store_cloud(void);
         void unload_cloud(void);
         void do_cull(void);
+        void do_statistical_outlier_removal(void);
+        void do_radius_outlier_removal(void);
         void recalc_normals(void);
         void do_icp(void);
         void randomize_transformations(void);
@@ -47,12 +49,12 @@ class window:
         QScrollArea *options;
         QFrame *f[7];
         QCheckBox *smooth_points, *lighting, *colored, *rng, *renormal_inv;
-        QDoubleSpinBox *point_size, *normal_length, *fov, *ld_x, *ld_y, *ld_z, *cull_ratio, *icp_p;
-        QLabel *point_size_label, *normal_length_label, *fov_label, *ld, *k_label, *cull_ratio_label, *icp_n_label, *icp_m_label, *icp_p_label;
-        QPushButton *unify, *load, *store, *unload, *cull, *renormal, *icp, *rnd_trans;
+        QDoubleSpinBox *point_size, *normal_length, *fov, *ld_x, *ld_y, *ld_z, *cull_ratio, *icp_p, *knn_eps, *sor_std, *ror_radius;
+        QLabel *point_size_label, *normal_length_label, *fov_label, *ld, *k_label, *cull_ratio_label, *icp_n_label, *icp_m_label, *icp_p_label, *knn_eps_label, *index_backend_label, *sor_std_label, *ror_radius_label, *ror_min_label;
+        QPushButton *unify, *load, *store, *unload, *cull, *renormal, *icp, *rnd_trans, *sor, *ror;
         QDoubleSpinBox *unify_res;
-        QComboBox *clouds;
-        QSpinBox *k, *icp_n, *icp_m;
+        QComboBox *clouds, *index_backend;
+        QSpinBox *k, *icp_n, *icp_m, *ror_min;
 };
 
 